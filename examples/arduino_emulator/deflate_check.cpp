@@ -0,0 +1,131 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright 2016-2026 Hristo Gochkov, Mathieu Carbou, Emil Muratov, Will Miles
+
+// Host-side round-trip check of the permessage-deflate codec, run by the Arduino Emulator CI build.
+// Every payload is compressed, the 0x00 0x00 0xff 0xff trailer is appended back as the server does on receive, and the result is decompressed again.
+
+#include <AsyncWebSocketDeflate.h>
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+using namespace asyncsrv;
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                    \
+  if (!(cond)) {                            \
+    failures++;                             \
+    printf("FAIL line %d: ", __LINE__);     \
+    printf(__VA_ARGS__);                    \
+    printf("\n");                           \
+  }
+
+static const uint8_t trailer[] = {0x00, 0x00, 0xff, 0xff};
+
+static WsInflateStatus inflateMessage(const uint8_t *data, size_t len, std::vector<uint8_t> &out, size_t maxSize) {
+  std::vector<uint8_t> in(data, data + len);
+  in.insert(in.end(), trailer, trailer + sizeof(trailer));
+  return wsInflate(in.data(), in.size(), out, maxSize);
+}
+
+// compressible payload: records with a lot of repeated text
+static std::vector<uint8_t> records(size_t len) {
+  std::string s;
+  for (unsigned i = 0; s.size() < len; i++) {
+    char buf[96];
+    snprintf(buf, sizeof(buf), "{\"sensor\":%u,\"name\":\"temperature\",\"value\":%u.%u,\"unit\":\"celsius\"}\n", i, 20 + i % 7, i * 3 % 10);
+    s += buf;
+  }
+  return std::vector<uint8_t>(s.begin(), s.begin() + len);
+}
+
+// incompressible payload: pseudo-random bytes
+static std::vector<uint8_t> noise(size_t len, uint32_t seed) {
+  std::vector<uint8_t> v(len);
+  for (size_t i = 0; i < len; i++) {
+    seed = seed * 1664525 + 1013904223;
+    v[i] = seed >> 24;
+  }
+  return v;
+}
+
+// a random block repeated, the matches are found at the distance of its period only
+static std::vector<uint8_t> repeated(size_t period, size_t len) {
+  std::vector<uint8_t> block = noise(period, 1);
+  std::vector<uint8_t> v;
+  while (v.size() < len) {
+    v.insert(v.end(), block.begin(), block.end());
+  }
+  v.resize(len);
+  return v;
+}
+
+static void roundTrip(const char *name, const std::vector<uint8_t> &payload, uint8_t windowBits, bool mustCompress) {
+  std::shared_ptr<std::vector<uint8_t>> deflated = wsDeflate(payload.data(), payload.size(), windowBits);
+  if (!deflated) {
+    // sent uncompressed
+    CHECK(!mustCompress, "%s: %u bytes not compressed with window bits %u", name, (unsigned)payload.size(), windowBits);
+    return;
+  }
+  CHECK(deflated->size() < payload.size() || payload.empty(), "%s: %u bytes compressed to %u", name, (unsigned)payload.size(), (unsigned)deflated->size());
+
+  std::vector<uint8_t> out;
+  WsInflateStatus status = inflateMessage(deflated->data(), deflated->size(), out, payload.size());
+  CHECK(status == WS_INFLATE_OK && out == payload, "%s: %u bytes with window bits %u do not round-trip", name, (unsigned)payload.size(), windowBits);
+
+  if (!payload.empty()) {
+    status = inflateMessage(deflated->data(), deflated->size(), out, payload.size() - 1);
+    CHECK(status == WS_INFLATE_TOO_LARGE, "%s: %u bytes with window bits %u inflated beyond the max size", name, (unsigned)payload.size(), windowBits);
+  }
+}
+
+// raw DEFLATE stream produced by zlib (level 9, dynamic Huffman block, Z_SYNC_FLUSH) from records(770), with the 0x00 0x00 0xff 0xff tail removed
+static const uint8_t zlibStream[] = {
+  0x84, 0xd2, 0x39, 0x0a, 0xc3, 0x30, 0x10, 0x85, 0xe1, 0x3e, 0xc7, 0x98, 0xda, 0x0c, 0xda, 0xbd, 0xdc, 0x46, 0x04, 0x15, 0x06, 0x5b, 0x09, 0x5a, 0xd2, 0x98,
+  0xdc, 0xdd, 0xaa, 0x52, 0x85, 0x79, 0xed, 0x30, 0x5f, 0xf5, 0xbf, 0x8b, 0x6a, 0xca, 0xf5, 0x55, 0x68, 0x53, 0x13, 0xe5, 0x78, 0x26, 0xda, 0xa8, 0xa5, 0xf3,
+  0x9d, 0x4a, 0x6c, 0xbd, 0x24, 0x9a, 0xe8, 0x13, 0x8f, 0x3e, 0xae, 0x46, 0xf1, 0xf8, 0xe8, 0x79, 0x6f, 0xe3, 0xe3, 0x99, 0x8e, 0xba, 0xf7, 0x4a, 0xdf, 0xc7,
+  0xf5, 0xf3, 0x1a, 0x78, 0xcd, 0x56, 0xf4, 0x06, 0x78, 0xc3, 0x41, 0xf4, 0x16, 0x78, 0xcb, 0xab, 0xe8, 0x1d, 0xf0, 0x8e, 0x8d, 0xe8, 0x3d, 0xf0, 0x9e, 0xbd,
+  0xe8, 0x03, 0xf0, 0x81, 0x17, 0xd1, 0xcf, 0xb0, 0x9f, 0x16, 0xfd, 0x02, 0xfb, 0x39, 0xd1, 0xaf, 0xb0, 0xdf, 0x2c, 0xef, 0x47, 0xc1, 0x80, 0x60, 0x80, 0x1a,
+  0x16, 0xfc, 0xb7, 0xc0, 0x1b,
+};
+
+int main() {
+  for (uint8_t windowBits : {9, 11, 15}) {
+    const size_t window = (size_t)1 << windowBits;
+    roundTrip("empty", std::vector<uint8_t>(), windowBits, false);
+    roundTrip("1 byte", std::vector<uint8_t>(1, 'a'), windowBits, false);
+    // WS_DEFLATE_THRESHOLD: default threshold of AsyncWebSocket::enablePerMessageDeflate()
+    roundTrip("above threshold", records(WS_DEFLATE_THRESHOLD + 1), windowBits, true);
+    roundTrip("records", records(16384), windowBits, true);
+    roundTrip("incompressible", noise(4096, 7), windowBits, false);
+    for (size_t len : {window - 1, window, window + 1, 2 * window + 3}) {
+      roundTrip("window boundary", records(len), windowBits, true);
+      // matches at the largest distance of the window, and just beyond it
+      roundTrip("window distance", repeated(window - 1, len + window - 1), windowBits, true);
+      roundTrip("beyond window", repeated(window, len + window), windowBits, false);
+    }
+  }
+
+  // an incompressible payload must be sent uncompressed
+  CHECK(!wsDeflate(noise(4096, 7).data(), 4096, 11), "incompressible payload compressed");
+
+  // message compressed by a client using zlib
+  std::vector<uint8_t> out;
+  const std::vector<uint8_t> expected = records(770);
+  WsInflateStatus status = inflateMessage(zlibStream, sizeof(zlibStream), out, 4096);
+  CHECK(status == WS_INFLATE_OK && out == expected, "zlib stream: status %d, %u bytes", (int)status, (unsigned)out.size());
+
+  // truncated and corrupted streams are rejected
+  status = inflateMessage(zlibStream, sizeof(zlibStream) / 2, out, 4096);
+  CHECK(status == WS_INFLATE_ERROR, "truncated zlib stream: status %d", (int)status);
+  std::vector<uint8_t> corrupted(zlibStream, zlibStream + sizeof(zlibStream));
+  corrupted[0] |= 0x06;  // reserved block type
+  status = inflateMessage(corrupted.data(), corrupted.size(), out, 4096);
+  CHECK(status == WS_INFLATE_ERROR, "reserved block type: status %d", (int)status);
+
+  printf("deflate round-trip: %s\n", failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
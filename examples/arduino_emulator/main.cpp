@@ -9,6 +9,45 @@ void setup() {
     request->send(200, "text/plain", "ESPAsyncWebServer host app is running on port 8080\n");
   });
 
+  // Template with large placeholder values, used to benchmark template processing on the host
+  //
+  // autocannon -c 16 -w 16 -d 20 --renderStatusCodes http://127.0.0.1:8080/template
+  //
+  server.on("/template", HTTP_GET, [](AsyncWebServerRequest *request) {
+    static const char tpl[] = "<p>%LARGE%</p>\n<p>%SMALL%</p>\n<p>%LARGE%</p>\n";
+    request->send(200, "text/html", (const uint8_t *)tpl, sizeof(tpl) - 1, [](const String &var) -> String {
+      if (var == "LARGE") {
+        String value;
+        value.reserve(8192);
+        while (value.length() < 8192) {
+          value += "0123456789abcdef";
+        }
+        return value;
+      }
+      return var;
+    });
+  });
+
+#if ASYNC_JSON_SUPPORT == 1 && ARDUINOJSON_VERSION_MAJOR == 7
+  // JSON document of a requested size (num of array items), used to benchmark serialization CPU time against document size
+  //
+  // autocannon -c 16 -w 16 -d 20 --renderStatusCodes "http://127.0.0.1:8080/json?items=1000"
+  //
+  server.on("/json", HTTP_GET, [](AsyncWebServerRequest *request) {
+    const long items = request->hasParam("items") ? request->getParam("items")->value().toInt() : 100;
+    AsyncJsonResponse *response = new AsyncJsonResponse();
+    JsonArray root = response->getRoot().to<JsonArray>();
+    for (long i = 0; i < items; i++) {
+      JsonObject item = root.add<JsonObject>();
+      item["id"] = i;
+      item["name"] = "sensor";
+      item["value"] = i * 0.5;
+    }
+    response->setLength();
+    request->send(response);
+  });
+#endif
+
   server.onNotFound([](AsyncWebServerRequest *request) {
     request->send(404, "text/plain", "Not found\n");
   });
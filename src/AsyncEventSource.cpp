@@ -4,100 +4,182 @@
 #include "AsyncEventSource.h"
 #include "AsyncWebServerLogging.h"
 
+#include <string.h>
+
 #include <algorithm>
 #include <memory>
+#include <new>
 #include <utility>
 
 #define ASYNC_SSE_NEW_LINE_CHAR (char)0xa
 
 using namespace asyncsrv;
 
-static String generateEventMessage(const char *message, const char *event, uint32_t id, uint32_t reconnect) {
-  String str;
-  size_t len{0};
-  if (message) {
-    len += strlen(message);
+/**
+ * @brief Print writing SSE data lines: a "data: " prefix is inserted before each line of the printed data,
+ * \r\n, \r or \n line breaks are all written as \n.
+ * Without destination String it only counts the bytes it would write, so an event can be sized exactly before it is written.
+ */
+class AsyncEventDataPrint : public Print {
+private:
+  String *_out;
+  size_t _len{0};          // num of bytes written, or that would be written
+  bool _lineOpen{false};  // "data: " prefix already written for the current line
+  bool _skipLF{false};    // last byte was a \r, a \n following it ends the same line
+
+  void _put(const char *data, size_t len) {
+    if (_out) {
+      _out->concat(data, len);
+    }
+    _len += len;
   }
 
-  if (event) {
-    len += strlen(event);
+public:
+  explicit AsyncEventDataPrint(String *out = nullptr) : _out(out) {}
+
+  size_t write(uint8_t c) {
+    return write(&c, 1);
   }
 
-  len += 42;  // give it some overhead
+  size_t write(const uint8_t *buffer, size_t size) {
+    const char *data = reinterpret_cast<const char *>(buffer);
+    const char *end = data + size;
+    while (data < end) {
+      if (_skipLF) {
+        _skipLF = false;
+        if (*data == '\n') {
+          data++;
+          continue;
+        }
+      }
+      if (!_lineOpen) {
+        _put(T_data_, sizeof(T_data_) - 1);
+        _lineOpen = true;
+      }
+      if (*data == '\r' || *data == '\n') {
+        _put("\n", 1);
+        _lineOpen = false;
+        _skipLF = *data == '\r';
+        data++;
+        continue;
+      }
+      // copy a run of bytes up to the next line break at once
+      const char *lineEnd = data;
+      while (lineEnd < end && *lineEnd != '\r' && *lineEnd != '\n') {
+        lineEnd++;
+      }
+      _put(data, lineEnd - data);
+      data = lineEnd;
+    }
+    return size;
+  }
 
-  if (!str.reserve(len)) {
-    async_ws_log_e("Failed to allocate");
-    return asyncsrv::emptyString;
+  // terminate the last data line and the event, empty data is sent as a single empty data line
+  void end() {
+    if (!_len) {
+      _put(T_data_, sizeof(T_data_) - 1);
+      _lineOpen = true;
+    }
+    _put(T_nn, _lineOpen ? 2 : 1);
+    _lineOpen = false;
   }
 
-  if (reconnect) {
-    str += T_retry_;
-    str += reconnect;
-    str += ASYNC_SSE_NEW_LINE_CHAR;  // '\n'
+  size_t length() const {
+    return _len;
   }
+};
 
+static size_t decimalLength(uint32_t value) {
+  size_t len = 1;
+  while (value >= 10) {
+    value /= 10;
+    len++;
+  }
+  return len;
+}
+
+/**
+ * @brief format an event into a shared String allocated once, at its exact size
+ *
+ * @param produce prints the event data to the Print it is given, it is called twice: to size the event, then to write it.
+ * If it is null, the event has no data lines
+ * @return the event, or nullptr if allocation failed
+ */
+template <typename Producer>
+static AsyncEvent_SharedData_t formatEventMessage(const Producer *produce, const char *event, uint32_t id, uint32_t reconnect) {
+  size_t len = 0;
+  if (reconnect) {
+    len += sizeof(T_retry_) - 1 + decimalLength(reconnect) + 1;
+  }
   if (id) {
-    str += T_id__;
-    str += id;
-    str += ASYNC_SSE_NEW_LINE_CHAR;  // '\n'
+    len += sizeof(T_id__) - 1 + decimalLength(id) + 1;
+  }
+  if (event) {
+    len += sizeof(T_event_) - 1 + strlen(event) + 1;
+  }
+  if (produce) {
+    AsyncEventDataPrint sizing;
+    (*produce)(sizing);
+    sizing.end();
+    len += sizing.length();
+  } else {
+    len += 1;
   }
 
-  if (event != NULL) {
-    str += T_event_;
-    str += event;
-    str += ASYNC_SSE_NEW_LINE_CHAR;  // '\n'
+  AsyncEvent_SharedData_t str = std::make_shared<String>();
+  if (!str->reserve(len)) {
+    async_ws_log_e("Failed to allocate");
+    return nullptr;
   }
 
-  if (!message) {
-    return str;
-  }
-
-  size_t messageLen = strlen(message);
-  char *lineStart = (char *)message;
-  char *lineEnd;
-  do {
-    char *nextN = strchr(lineStart, '\n');
-    char *nextR = strchr(lineStart, '\r');
-    if (nextN == NULL && nextR == NULL) {
-      // a message is a single-line string
-      str += T_data_;
-      str += message;
-      str += T_nn;
-      return str;
-    }
+  if (reconnect) {
+    *str += T_retry_;
+    *str += reconnect;
+    *str += ASYNC_SSE_NEW_LINE_CHAR;  // '\n'
+  }
 
-    // a message is a multi-line string
-    char *nextLine = NULL;
-    if (nextN != NULL && nextR != NULL) {  // windows line-ending \r\n
-      if (nextR + 1 == nextN) {
-        // normal \r\n sequence
-        lineEnd = nextR;
-        nextLine = nextN + 1;
-      } else {
-        // some abnormal \n \r mixed sequence
-        lineEnd = std::min(nextR, nextN);
-        nextLine = lineEnd + 1;
-      }
-    } else if (nextN != NULL) {  // Unix/Mac OS X LF
-      lineEnd = nextN;
-      nextLine = nextN + 1;
-    } else {  // some ancient garbage
-      lineEnd = nextR;
-      nextLine = nextR + 1;
-    }
+  if (id) {
+    *str += T_id__;
+    *str += id;
+    *str += ASYNC_SSE_NEW_LINE_CHAR;  // '\n'
+  }
 
-    str += T_data_;
-    str.concat(lineStart, lineEnd - lineStart);
-    str += ASYNC_SSE_NEW_LINE_CHAR;  // \n
+  if (event) {
+    *str += T_event_;
+    *str += event;
+    *str += ASYNC_SSE_NEW_LINE_CHAR;  // '\n'
+  }
 
-    lineStart = nextLine;
-  } while (lineStart < ((char *)message + messageLen));
+  if (produce) {
+    AsyncEventDataPrint writer(str.get());
+    (*produce)(writer);
+    writer.end();
+  } else {
+    // terminate the event, or its fields would be merged with the next event
+    *str += ASYNC_SSE_NEW_LINE_CHAR;  // '\n'
+  }
+  return str;
+}
 
-  // append another \n to terminate message
-  str += ASYNC_SSE_NEW_LINE_CHAR;  // '\n'
+static AsyncEvent_SharedData_t generateEventMessage(const char *message, const char *event, uint32_t id, uint32_t reconnect) {
+  if (!message) {
+    return formatEventMessage<ArEventProducerFunction>(nullptr, event, id, reconnect);
+  }
+  const size_t messageLen = strlen(message);
+  const auto produce = [message, messageLen](Print &dest) {
+    dest.write(reinterpret_cast<const uint8_t *>(message), messageLen);
+  };
+  return formatEventMessage(&produce, event, id, reconnect);
+}
 
-  return str;
+#if ARDUINOJSON_VERSION_MAJOR >= 6
+static AsyncEvent_SharedData_t generateEventMessage(JsonVariantConst json, const char *event, uint32_t id, uint32_t reconnect) {
+  const auto produce = [&json](Print &dest) {
+    serializeJson(json, dest);
+  };
+  return formatEventMessage(&produce, event, id, reconnect);
 }
+#endif
 
 // Message
 
@@ -140,6 +222,12 @@ size_t AsyncEventSourceMessage::write(AsyncClient *client) {
   return written;
 }
 
+size_t AsyncEventSourceMessage::copyPending(uint8_t *dest) const {
+  const size_t len = remaining();
+  memcpy(dest, _data->c_str() + _sent, len);
+  return len;
+}
+
 size_t AsyncEventSourceMessage::send(AsyncClient *client) {
   size_t sent = write(client);
   return sent && client->send() ? sent : 0;
@@ -147,7 +235,8 @@ size_t AsyncEventSourceMessage::send(AsyncClient *client) {
 
 // Client
 
-AsyncEventSourceClient::AsyncEventSourceClient(AsyncWebServerRequest *request, AsyncEventSource *server) : _client(request->clientRelease()), _server(server) {
+AsyncEventSourceClient::AsyncEventSourceClient(AsyncWebServerRequest *request, AsyncEventSource *server, size_t headLength)
+  : _client(request->clientRelease()), _server(server), _headUnacked(headLength) {
 
   if (request->hasHeader(T_Last_Event_ID)) {
     _lastId = atoi(request->getHeader(T_Last_Event_ID)->value().c_str());
@@ -184,10 +273,12 @@ AsyncEventSourceClient::AsyncEventSourceClient(AsyncWebServerRequest *request, A
     this
   );
 
-  _server->_addClient(this);
   _client->setNoDelay(true);
-  // delete AsyncWebServerRequest object (and bound response) since we have the ownership on client connection now
-  delete request;
+  _server->_addClient(this);
+  // push the response head if no message was sent with it
+  if (_client) {
+    _client->send();
+  }
 }
 
 AsyncEventSourceClient::~AsyncEventSourceClient() {
@@ -207,7 +298,10 @@ bool AsyncEventSourceClient::_queueMessage(const char *message, size_t len) {
   }
 
   if (_client) {
-    _messageQueue.emplace_back(message, len);
+    if (!_messageQueue.emplace_back(message, len)) {
+      async_ws_log_e("Failed to allocate");
+      return false;
+    }
   } else {
     _messageQueue.clear();
     return false;
@@ -236,7 +330,10 @@ bool AsyncEventSourceClient::_queueMessage(AsyncEvent_SharedData_t &&msg) {
   }
 
   if (_client) {
-    _messageQueue.emplace_back(std::move(msg));
+    if (!_messageQueue.emplace_back(std::move(msg))) {
+      async_ws_log_e("Failed to allocate");
+      return false;
+    }
   } else {
     _messageQueue.clear();
     return false;
@@ -258,6 +355,13 @@ void AsyncEventSourceClient::_onAck(size_t len __attribute__((unused)), uint32_t
   // Protect message queue access (size checks and modifications) which is not thread-safe.
   asyncsrv::lock_guard_type lock(_lockmq);
 
+  // the first bytes acked are the response head
+  if (_headUnacked) {
+    const size_t head = std::min(len, _headUnacked);
+    _headUnacked -= head;
+    len -= head;
+  }
+
   // adjust in-flight len
   if (len < _inflight) {
     _inflight -= len;
@@ -312,9 +416,28 @@ bool AsyncEventSourceClient::send(const char *message, const char *event, uint32
   if (!connected()) {
     return false;
   }
-  return _queueMessage(std::make_shared<String>(generateEventMessage(message, event, id, reconnect)));
+  AsyncEvent_SharedData_t msg = generateEventMessage(message, event, id, reconnect);
+  return msg && _queueMessage(std::move(msg));
 }
 
+bool AsyncEventSourceClient::send(const ArEventProducerFunction &producer, const char *event, uint32_t id, uint32_t reconnect) {
+  if (!connected()) {
+    return false;
+  }
+  AsyncEvent_SharedData_t msg = formatEventMessage(&producer, event, id, reconnect);
+  return msg && _queueMessage(std::move(msg));
+}
+
+#if ARDUINOJSON_VERSION_MAJOR >= 6
+bool AsyncEventSourceClient::sendJson(JsonVariantConst json, const char *event, uint32_t id, uint32_t reconnect) {
+  if (!connected()) {
+    return false;
+  }
+  AsyncEvent_SharedData_t msg = generateEventMessage(json, event, id, reconnect);
+  return msg && _queueMessage(std::move(msg));
+}
+#endif
+
 void AsyncEventSourceClient::_runQueue() {
   if (!_client) {
     return;
@@ -322,15 +445,51 @@ void AsyncEventSourceClient::_runQueue() {
 
   // there is no need to lock the mutex here, 'cause all the calls to this method must be already lock'ed
   size_t total_bytes_written = 0;
-  for (auto i = _messageQueue.begin(); i != _messageQueue.end(); ++i) {
-    if (!i->sent()) {
-      const size_t bytes_written = i->write(_client);
-      total_bytes_written += bytes_written;
-      _inflight += bytes_written;
-      if (bytes_written == 0 || _inflight > _max_inflight) {
-        // Serial.print("_");
-        break;
+  size_t i = 0;
+  while (i < _messageQueue.size() && _messageQueue[i].sent()) {
+    ++i;
+  }
+
+  while (i < _messageQueue.size() && _inflight <= _max_inflight && _client->canSend()) {
+    // consecutive messages that fit in the batch buffer are written at once, with a single add() instead of one per message
+    const size_t room = std::min(std::min((size_t)SSE_BATCH_SIZE, _client->space()), _max_inflight - _inflight);
+    size_t batchLen = 0;
+    size_t batchEnd = i;
+    while (batchEnd < _messageQueue.size() && batchLen + _messageQueue[batchEnd].remaining() <= room) {
+      batchLen += _messageQueue[batchEnd].remaining();
+      ++batchEnd;
+    }
+    if (batchEnd - i > 1 && !_batch) {
+      _batch.reset(new (std::nothrow) uint8_t[SSE_BATCH_SIZE]);
+    }
+
+    size_t bytes_written;
+    if (batchEnd - i > 1 && _batch) {
+      size_t copied = 0;
+      for (size_t j = i; j < batchEnd; ++j) {
+        copied += _messageQueue[j].copyPending(_batch.get() + copied);
+      }
+      bytes_written = _client->add(reinterpret_cast<const char *>(_batch.get()), batchLen, ASYNC_WRITE_FLAG_COPY);
+      // the socket buffer may have taken only the leading part of the batch
+      for (size_t left = bytes_written; left;) {
+        const size_t len = std::min(left, _messageQueue[i].remaining());
+        _messageQueue[i].markSent(len);
+        left -= len;
+        if (_messageQueue[i].sent()) {
+          ++i;
+        }
       }
+    } else {
+      bytes_written = _messageQueue[i].write(_client);
+      if (_messageQueue[i].sent()) {
+        ++i;
+      }
+    }
+
+    total_bytes_written += bytes_written;
+    _inflight += bytes_written;
+    if (bytes_written == 0) {
+      break;
     }
   }
 
@@ -359,14 +518,69 @@ void AsyncEventSource::_addClient(AsyncEventSourceClient *client) {
     return;
   }
 
-  if (_connectcb) {
-    _connectcb(client);
+  bool replayed;
+  {
+    asyncsrv::lock_guard_type lock(_client_queue_lock);
+    // replay the missed events and add the client at once, so no event sent meanwhile can be lost,
+    // the messages sent from the connect callback are queued after the replayed ones
+    replayed = _replayTo(client);
+    if (_connectcb) {
+      _connectcb(client);
+    }
+    _clients.emplace_back(client);
+
+    _adjust_inflight_window();
   }
 
+  if (!replayed && _replayGapcb) {
+    _replayGapcb(client);
+  }
+}
+
+void AsyncEventSource::setReplayBuffer(size_t maxEvents, size_t maxBytes) {
   asyncsrv::lock_guard_type lock(_client_queue_lock);
-  _clients.emplace_back(client);
+  _replayMaxEvents = maxEvents;
+  _replayMaxBytes = maxBytes;
+  _trimReplay(0, 0);
+  if (maxEvents && !_replay.reserve(maxEvents)) {
+    async_ws_log_e("Failed to allocate");
+  }
+}
 
-  _adjust_inflight_window();
+// all calls to this method MUST be protected by _client_queue_lock
+void AsyncEventSource::_trimReplay(size_t events, size_t bytes) {
+  while (!_replay.empty() && (_replay.size() + events > _replayMaxEvents || _replayBytes + bytes > _replayMaxBytes)) {
+    _replayBytes -= _replay.front().data->length();
+    _replay.pop_front();
+  }
+}
+
+// all calls to this method MUST be protected by _client_queue_lock
+bool AsyncEventSource::_replayTo(AsyncEventSourceClient *client) {
+  const uint32_t lastId = client->lastId();
+  if (!lastId) {
+    // first connection, nothing was missed
+    return true;
+  }
+
+  // the client got the events up to the last one with its id, replay those after it
+  size_t next = _replay.size();
+  while (next && _replay[next - 1].id != lastId) {
+    next--;
+  }
+  if (!next) {
+    async_ws_log_d("[%s] Last-Event-ID %" PRIu32 " not kept: can't replay", _url.c_str(), lastId);
+    return false;
+  }
+  const size_t missed = _replay.size() - next;
+  if (missed + client->packetsWaiting() > SSE_MAX_QUEUED_MESSAGES) {
+    async_ws_log_w("[%s] Too many events to replay: %" PRIu32, _url.c_str(), static_cast<uint32_t>(missed));
+    return false;
+  }
+  for (; next < _replay.size(); next++) {
+    client->write(_replay[next].data);
+  }
+  return true;
 }
 
 void AsyncEventSource::_handleDisconnect(AsyncEventSourceClient *client) {
@@ -415,8 +629,35 @@ size_t AsyncEventSource::avgPacketsWaiting() const {
 }
 
 AsyncEventSource::SendStatus AsyncEventSource::send(const char *message, const char *event, uint32_t id, uint32_t reconnect) {
-  AsyncEvent_SharedData_t shared_msg = std::make_shared<String>(generateEventMessage(message, event, id, reconnect));
+  return _send(generateEventMessage(message, event, id, reconnect), id);
+}
+
+AsyncEventSource::SendStatus AsyncEventSource::send(const ArEventProducerFunction &producer, const char *event, uint32_t id, uint32_t reconnect) {
+  return _send(formatEventMessage(&producer, event, id, reconnect), id);
+}
+
+#if ARDUINOJSON_VERSION_MAJOR >= 6
+AsyncEventSource::SendStatus AsyncEventSource::sendJson(JsonVariantConst json, const char *event, uint32_t id, uint32_t reconnect) {
+  return _send(generateEventMessage(json, event, id, reconnect), id);
+}
+#endif
+
+AsyncEventSource::SendStatus AsyncEventSource::_send(AsyncEvent_SharedData_t shared_msg, uint32_t id) {
+  if (!shared_msg) {
+    return DISCARDED;
+  }
   asyncsrv::lock_guard_type lock(_client_queue_lock);
+  // kept even if no client is connected: the clients may be reconnecting
+  if (_replayMaxEvents) {
+    _trimReplay(1, shared_msg->length());
+    if (shared_msg->length() <= _replayMaxBytes && _replay.emplace_back(id, shared_msg)) {
+      _replayBytes += shared_msg->length();
+    } else {
+      // the kept events must have no hole, the older ones can't be replayed anymore
+      _replay.clear();
+      _replayBytes = 0;
+    }
+  }
   size_t hits = 0;
   size_t miss = 0;
   for (const auto &c : _clients) {
@@ -478,24 +719,16 @@ AsyncEventSourceResponse::AsyncEventSourceResponse(AsyncEventSource *server) : _
 void AsyncEventSourceResponse::_respond(AsyncWebServerRequest *request) {
   String out;
   _assembleHead(out, request->version());
-  // unbind client's onAck callback from AsyncWebServerRequest's, we will destroy it on next callback and steal the client,
-  // can't do it now 'cause now we are in AsyncWebServerRequest::_onAck 's stack actually
-  // here we are loosing time on one RTT delay, but with current design we can't get rid of Req/Resp objects other way
-  _request = request;
-  request->client()->onAck(
-    [](void *r, AsyncClient *c, size_t len, uint32_t time) {
-      if (len) {
-        static_cast<AsyncEventSourceResponse *>(r)->_switchClient();
-      }
-    },
-    this
-  );
-  request->client()->write(out.c_str(), _headLength);
-  _state = RESPONSE_WAIT_ACK;
-}
-
-void AsyncEventSourceResponse::_switchClient() {
+  // the connection is switched to the SSE client right away, without waiting for the ack of the head:
+  // the head is only added to the TCP buffer and the client pushes it with the messages sent on connect.
+  // The request (and *this) are deleted once the current AsyncTCP callback returns, see AsyncWebServerRequest::clientRelease()
+  if (request->client()->add(out.c_str(), _headLength) < _headLength) {
+    async_ws_log_e("Failed to add the response head");
+    _state = RESPONSE_FAILED;
+    request->client()->close();
+    return;
+  }
+  _state = RESPONSE_END;
   // AsyncEventSourceClient c-tor will take the ownership of AsyncTCP's client connection
-  new AsyncEventSourceClient(_request, _server);
-  // AsyncEventSourceClient c-tor would also delete _request and *this
-};
+  new AsyncEventSourceClient(request, _server, _headLength);
+}
@@ -18,6 +18,9 @@
 #endif
 #define SSE_MIN_INFLIGH 2 * 1460   // allow 2 MSS packets
 #define SSE_MAX_INFLIGH 16 * 1024  // but no more than 16k, no need to blow it, since same data is kept in local Q
+#ifndef SSE_BATCH_SIZE
+#define SSE_BATCH_SIZE 1460  // queued messages are gathered in up to one MSS before being added to the socket buffer
+#endif
 #elif defined(ESP8266)
 #include <ESPAsyncTCP.h>
 #ifndef SSE_MAX_QUEUED_MESSAGES
@@ -25,6 +28,9 @@
 #endif
 #define SSE_MIN_INFLIGH 2 * 1460  // allow 2 MSS packets
 #define SSE_MAX_INFLIGH 8 * 1024  // but no more than 8k, no need to blow it, since same data is kept in local Q
+#ifndef SSE_BATCH_SIZE
+#define SSE_BATCH_SIZE 536  // queued messages are gathered in up to one MSS before being added to the socket buffer
+#endif
 #elif defined(TARGET_RP2040) || defined(TARGET_RP2350) || defined(PICO_RP2040) || defined(PICO_RP2350)
 #include <RPAsyncTCP.h>
 #ifndef SSE_MAX_QUEUED_MESSAGES
@@ -32,9 +38,22 @@
 #endif
 #define SSE_MIN_INFLIGH 2 * 1460   // allow 2 MSS packets
 #define SSE_MAX_INFLIGH 16 * 1024  // but no more than 16k, no need to blow it, since same data is kept in local Q
+#ifndef SSE_BATCH_SIZE
+#define SSE_BATCH_SIZE 1460  // queued messages are gathered in up to one MSS before being added to the socket buffer
+#endif
+#endif
+
+// num of events sent to all clients kept to be replayed to reconnecting clients, 0 to disable, see AsyncEventSource::setReplayBuffer()
+#ifndef SSE_REPLAY_EVENTS
+#define SSE_REPLAY_EVENTS 0
+#endif
+// max total size of the events kept to be replayed
+#ifndef SSE_REPLAY_BYTES
+#define SSE_REPLAY_BYTES 4096
 #endif
 
 #include <ESPAsyncWebServer.h>
+#include "AsyncRingQueue.h"
 
 #ifdef ESP8266
 #include <Hash.h>
@@ -54,6 +73,8 @@ using ArEventHandlerFunction = std::function<void(AsyncEventSourceClient *client
 using ArAuthorizeConnectHandler = ArAuthorizeFunction;
 // shared message object container
 using AsyncEvent_SharedData_t = std::shared_ptr<String>;
+// prints the data of an event, see AsyncEventSource::send()
+using ArEventProducerFunction = std::function<void(Print &dest)>;
 
 /**
  * @brief Async Event Message container with shared message content data
@@ -110,6 +131,24 @@ public:
      */
   size_t send(AsyncClient *client);
 
+  // num of bytes not sent yet
+  size_t remaining() const {
+    return _data->length() - _sent;
+  }
+
+  /**
+     * @brief copy the data not sent yet to @p dest, to write it to client's buffer along with other messages
+     * @note the data is not marked as sent, see markSent()
+     *
+     * @return size_t number of bytes copied
+     */
+  size_t copyPending(uint8_t *dest) const;
+
+  // mark @p len more bytes as written to client's buffer
+  void markSent(size_t len) {
+    _sent += len;
+  }
+
   // returns true if full message's length were acked
   bool finished() {
     return _acked == _data->length();
@@ -133,9 +172,12 @@ private:
   AsyncClient *_client;
   AsyncEventSource *_server;
   uint32_t _lastId{0};
+  size_t _headUnacked{0};                 // num of unacknowledged bytes of the response head, sent before the client took the connection over
   size_t _inflight{0};                    // num of unacknowledged bytes that has been written to socket buffer
   size_t _max_inflight{SSE_MAX_INFLIGH};  // max num of unacknowledged bytes that could be written to socket buffer
-  std::list<AsyncEventSourceMessage> _messageQueue;
+  AsyncRingQueue<AsyncEventSourceMessage> _messageQueue{SSE_MAX_QUEUED_MESSAGES};
+  // small queued messages are copied here to be written to the socket buffer at once, allocated on first use
+  std::unique_ptr<uint8_t[]> _batch;
   mutable asyncsrv::mutex_type _lockmq;
   bool _queueMessage(const char *message, size_t len);
   bool _queueMessage(AsyncEvent_SharedData_t &&msg);
@@ -144,12 +186,14 @@ private:
 public:
   /**
    * @brief Construct a new Async Event Source Client object
-   * @note constructor would take the ownership of of AsyncTCP's client pointer from `request` parameter and call delete on it!
+   * @note constructor would take the ownership of of AsyncTCP's client pointer from `request` parameter,
+   * the request is deleted once the current AsyncTCP callback returns (see AsyncWebServerRequest::clientRelease())
    *
    * @param request
    * @param server
+   * @param headLength length of the response head added to the connection and not yet acknowledged
    */
-  AsyncEventSourceClient(AsyncWebServerRequest *request, AsyncEventSource *server);
+  AsyncEventSourceClient(AsyncWebServerRequest *request, AsyncEventSource *server, size_t headLength = 0);
   ~AsyncEventSourceClient();
 
   /**
@@ -171,6 +215,24 @@ public:
     return send(message.c_str(), event, id, reconnect);
   }
 
+  /**
+     * @brief Send an SSE message to client, its data is printed by @p producer straight into the message
+     * @note @p producer is called twice, to size the message and then to write it: it must print the same data both times
+     *
+     * @param producer prints the message body, could be single or multi-line
+     * @param event body string, a sinle line string
+     * @param id sequence id
+     * @param reconnect client's reconnect timeout
+     * @return true if message was placed in a queue
+     * @return false if queue is full
+     */
+  bool send(const ArEventProducerFunction &producer, const char *event = NULL, uint32_t id = 0, uint32_t reconnect = 0);
+
+#if ARDUINOJSON_VERSION_MAJOR >= 6
+  // Send an SSE message to client with @p json serialized as its data, without intermediate String
+  bool sendJson(JsonVariantConst json, const char *event = NULL, uint32_t id = 0, uint32_t reconnect = 0);
+#endif
+
   /**
      * @brief place supplied preformatted SSE message to the message queue
      * @note message must a properly formatted SSE string according to https://developer.mozilla.org/en-US/docs/Web/API/Server-sent_events/Using_server-sent_events
@@ -232,6 +294,13 @@ public:
   void _onDisconnect();
 };
 
+// an event sent to all clients, kept to be replayed to the clients that missed it
+struct AsyncEventSourceReplayEntry {
+  uint32_t id;
+  AsyncEvent_SharedData_t data;
+  AsyncEventSourceReplayEntry(uint32_t id, AsyncEvent_SharedData_t data) : id(id), data(std::move(data)) {}
+};
+
 /**
  * @brief a class that maintains all connected HTTP clients subscribed to SSE delivery
  * dispatches supplied messages to the client's queues
@@ -246,9 +315,19 @@ private:
   mutable asyncsrv::mutex_type _client_queue_lock;
   ArEventHandlerFunction _connectcb = nullptr;
   ArEventHandlerFunction _disconnectcb = nullptr;
+  ArEventHandlerFunction _replayGapcb = nullptr;
+  // last events sent to all clients, oldest first, protected by _client_queue_lock
+  AsyncRingQueue<AsyncEventSourceReplayEntry> _replay{SSE_REPLAY_EVENTS};
+  size_t _replayBytes{0};
+  size_t _replayMaxEvents{SSE_REPLAY_EVENTS};
+  size_t _replayMaxBytes{SSE_REPLAY_BYTES};
 
   // this method manipulates in-fligh data size for connected client depending on number of active connections
   void _adjust_inflight_window();
+  // discard the oldest kept events until @p events events of @p bytes bytes in total could be added
+  void _trimReplay(size_t events, size_t bytes);
+  // queue the events a reconnecting client missed, returns false if they are not all kept anymore
+  bool _replayTo(AsyncEventSourceClient *client);
 
 public:
   typedef enum {
@@ -297,10 +376,49 @@ public:
     return send(message.c_str(), event, id, reconnect);
   }
 
+  /**
+     * @brief Send an SSE message to all clients, its data is printed by @p producer straight into the message shared by all the clients
+     * @note @p producer is called twice, to size the message and then to write it: it must print the same data both times
+     *
+     * @param producer prints the message body, could be single or multi-line
+     * @param event body string, a sinle line string
+     * @param id sequence id
+     * @param reconnect client's reconnect timeout
+     * @return SendStatus if message was placed in any/all/part of the client's queues
+     */
+  SendStatus send(const ArEventProducerFunction &producer, const char *event = NULL, uint32_t id = 0, uint32_t reconnect = 0);
+
+#if ARDUINOJSON_VERSION_MAJOR >= 6
+  // Send an SSE message to all clients with @p json serialized as its data, without intermediate String
+  SendStatus sendJson(JsonVariantConst json, const char *event = NULL, uint32_t id = 0, uint32_t reconnect = 0);
+#endif
+
   // The client pointer sent to the callback is only for reference purposes. DO NOT CALL ANY METHOD ON IT !
   void onDisconnect(ArEventHandlerFunction cb) {
     _disconnectcb = cb;
   }
+
+  /**
+     * @brief keep the last events sent to all clients, so the events a client missed while it was disconnected
+     * are replayed when it reconnects with the Last-Event-ID of the last event it got.
+     * Events are replayed after the on-connect callback, right before the client gets the events sent next.
+     * @note events are kept by reference, the shared message is not copied
+     *
+     * @param maxEvents max num of events kept, 0 to disable
+     * @param maxBytes max total size of the events kept
+     */
+  void setReplayBuffer(size_t maxEvents, size_t maxBytes = SSE_REPLAY_BYTES);
+
+  /**
+     * @brief set the callback called when a client reconnects with a Last-Event-ID but the events it missed can't be replayed:
+     * the event with this id was not kept or was already discarded, or the missed events would overflow the client's queue.
+     * Use it to send the client its full state again.
+     *
+     * @param cb
+     */
+  void onReplayGap(ArEventHandlerFunction cb) {
+    _replayGapcb = cb;
+  }
   void authorizeConnect(ArAuthorizeConnectHandler cb);
 
   // returns number of connected clients
@@ -314,14 +432,15 @@ public:
   void _handleDisconnect(AsyncEventSourceClient *client);
   bool canHandle(AsyncWebServerRequest *request) const final;
   void handleRequest(AsyncWebServerRequest *request) final;
+
+private:
+  // place a formatted message in all the client's queues and keep it for the replay
+  SendStatus _send(AsyncEvent_SharedData_t shared_msg, uint32_t id);
 };
 
 class AsyncEventSourceResponse : public AsyncWebServerResponse {
 private:
   AsyncEventSource *_server;
-  AsyncWebServerRequest *_request;
-  // this call back will switch AsyncTCP client to SSE
-  void _switchClient();
 
 public:
   AsyncEventSourceResponse(AsyncEventSource *server);
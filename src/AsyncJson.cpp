@@ -54,14 +54,25 @@ size_t AsyncJsonResponse::setLength() {
   return _contentLength;
 }
 
-size_t AsyncJsonResponse::_fillBuffer(uint8_t *data, size_t len) {
-  ChunkPrint dest(data, _sentLength, len);
+void AsyncJsonResponse::_serialize(Print &dest) {
 #if ARDUINOJSON_VERSION_MAJOR == 5
   _root.printTo(dest);
 #else
   serializeJson(_root, dest);
 #endif
-  return dest.written();
+}
+
+size_t AsyncJsonResponse::_fillBuffer(uint8_t *data, size_t len) {
+  // output kept from the last pass goes first
+  const size_t kept = _serialized.read(data, len);
+  if (kept == len) {
+    return kept;
+  }
+  // serialization can't be suspended: serialize again from the start, skip what was already produced
+  // and keep up to JSON_RESPONSE_BUFFER_SIZE bytes past this chunk for the next calls
+  ChunkPrint dest(data + kept, _sentLength + kept, len - kept, &_serialized);
+  _serialize(dest);
+  return kept + dest.written();
 }
 
 #if ARDUINOJSON_VERSION_MAJOR == 6
@@ -82,14 +93,12 @@ size_t PrettyAsyncJsonResponse::setLength() {
   return _contentLength;
 }
 
-size_t PrettyAsyncJsonResponse::_fillBuffer(uint8_t *data, size_t len) {
-  ChunkPrint dest(data, _sentLength, len);
+void PrettyAsyncJsonResponse::_serialize(Print &dest) {
 #if ARDUINOJSON_VERSION_MAJOR == 5
   _root.prettyPrintTo(dest);
 #else
   serializeJsonPretty(_root, dest);
 #endif
-  return dest.written();
 }
 
 // MessagePack content type response
@@ -103,10 +112,8 @@ size_t AsyncMessagePackResponse::setLength() {
   return _contentLength;
 }
 
-size_t AsyncMessagePackResponse::_fillBuffer(uint8_t *data, size_t len) {
-  ChunkPrint dest(data, _sentLength, len);
+void AsyncMessagePackResponse::_serialize(Print &dest) {
   serializeMsgPack(_root, dest);
-  return dest.written();
 }
 
 #endif
@@ -182,9 +189,15 @@ void AsyncCallbackJsonWebHandler::handleRequest(AsyncWebServerRequest *request)
       return;
     }
 #else
-    DeserializationError error = request->contentType().equalsIgnoreCase(asyncsrv::T_application_msgpack)
-                                   ? deserializeMsgPack(doc, (uint8_t *)(request->_tempObject))
-                                   : deserializeJson(doc, (const char *)request->_tempObject);
+    const bool msgPack = request->contentType().equalsIgnoreCase(asyncsrv::T_application_msgpack);
+    DeserializationError error;
+    if (_filter.isNull()) {
+      error = msgPack ? deserializeMsgPack(doc, (uint8_t *)(request->_tempObject)) : deserializeJson(doc, (const char *)request->_tempObject);
+    } else {
+      // fields not selected by the filter are skipped by the parser and never stored in the document
+      error = msgPack ? deserializeMsgPack(doc, (uint8_t *)(request->_tempObject), DeserializationOption::Filter(_filter))
+                      : deserializeJson(doc, (const char *)request->_tempObject, DeserializationOption::Filter(_filter));
+    }
     if (!error) {
       JsonVariant json = doc.as<JsonVariant>();
       _onRequest(request, json);
@@ -204,18 +217,14 @@ void AsyncCallbackJsonWebHandler::handleBody(AsyncWebServerRequest *request, uin
       return;
     }
 
-    if (index == 0) {
-      if (total == 0) {
-        // If total is 0, it is probably a chunked request without an
-        // X-Expected-Entity-Length header.  In that case there is
-        // no way to know the actual length in advance.  The best
-        // way to handle this would be to use a String instead of
-        // a fixed-length buffer, but for now we just reject.
-        async_ws_log_w("AsyncJson cannot handle chunked requests without X-Expected-Entity-Length");
-        request->abort();
-        return;
-      }
+    if (total == 0) {
+      // If total is 0, it is a chunked request without an X-Expected-Entity-Length header,
+      // the body size is only known once it is fully received.
+      _appendChunkedBody(request, data, len, index);
+      return;
+    }
 
+    if (index == 0) {
       // this check allows request->_tempObject to be initialized from a middleware
       if (request->_tempObject == NULL) {
         request->_tempObject = calloc(total + 1, sizeof(uint8_t));  // null-terminated string
@@ -227,11 +236,54 @@ void AsyncCallbackJsonWebHandler::handleBody(AsyncWebServerRequest *request, uin
       }
     }
 
-    if (request->_tempObject != NULL) {
+    // a chunked body could be longer than announced in X-Expected-Entity-Length
+    if (request->_tempObject != NULL && index < total) {
       uint8_t *buffer = (uint8_t *)request->_tempObject;
-      memcpy(buffer + index, data, len);
+      memcpy(buffer + index, data, std::min(len, total - index));
+    }
+  }
+}
+
+// Body buffer size for a chunked body of @p len bytes: the buffer grows geometrically, and since the size only depends
+// on the length received so far it does not have to be stored along with the buffer in _tempObject.
+static size_t chunkedBodyCapacity(size_t len) {
+  size_t capacity = 256;
+  while (capacity < len + 1) {
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+void AsyncCallbackJsonWebHandler::_appendChunkedBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index) {
+  if (len == 0) {
+    // final chunk
+    return;
+  }
+  if (index + len > _maxContentLength) {
+    async_ws_log_w("Content length exceeds maximum allowed");
+    request->abort();
+    return;
+  }
+  if (index && request->_tempObject == NULL) {
+    // allocation of a previous chunk failed
+    return;
+  }
+
+  const size_t capacity = chunkedBodyCapacity(index + len);
+  if (index == 0 || capacity != chunkedBodyCapacity(index)) {
+    // a buffer initialized from a middleware is resized as well
+    void *buffer = realloc(request->_tempObject, capacity);
+    if (buffer == NULL) {
+      async_ws_log_e("Failed to allocate");
+      request->abort();
+      return;
     }
+    request->_tempObject = buffer;
   }
+
+  uint8_t *buffer = (uint8_t *)request->_tempObject;
+  memcpy(buffer + index, data, len);
+  buffer[index + len] = 0;  // null-terminated string
 }
 
 #endif  // ASYNC_JSON_SUPPORT
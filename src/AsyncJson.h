@@ -16,6 +16,15 @@
 #endif
 #endif
 
+// max amount of serialized output kept ahead of the send buffer, the document is serialized once per this many bytes
+#ifndef JSON_RESPONSE_BUFFER_SIZE
+#ifdef ESP8266
+#define JSON_RESPONSE_BUFFER_SIZE 4096
+#else
+#define JSON_RESPONSE_BUFFER_SIZE 16384
+#endif
+#endif
+
 // Json content type response classes
 
 class AsyncJsonResponse : public AsyncAbstractResponse {
@@ -30,6 +39,11 @@ protected:
 
   JsonVariant _root;
   bool _isValid;
+  // output of the last serialization pass that did not fit into the send buffer
+  AsyncRingBuffer _serialized{JSON_RESPONSE_BUFFER_SIZE};
+
+  // serialize the whole document to @p dest
+  virtual void _serialize(Print &dest);
 
 public:
 #if ARDUINOJSON_VERSION_MAJOR == 6
@@ -63,7 +77,9 @@ public:
   PrettyAsyncJsonResponse(bool isArray = false);
 #endif
   size_t setLength() override;
-  size_t _fillBuffer(uint8_t *data, size_t len) override;
+
+protected:
+  void _serialize(Print &dest) override;
 };
 
 // MessagePack content type response
@@ -81,7 +97,9 @@ public:
   }
 #endif
   size_t setLength() override;
-  size_t _fillBuffer(uint8_t *data, size_t len) override;
+
+protected:
+  void _serialize(Print &dest) override;
 };
 
 #endif
@@ -95,9 +113,15 @@ protected:
   ArJsonRequestHandlerFunction _onRequest;
 #if ARDUINOJSON_VERSION_MAJOR == 6
   size_t maxJsonBufferSize;
+  DynamicJsonDocument _filter{0};
+#elif ARDUINOJSON_VERSION_MAJOR >= 7
+  JsonDocument _filter;
 #endif
   size_t _maxContentLength;
 
+  // store the next part of a body received without a known length
+  void _appendChunkedBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index);
+
 public:
 #if ARDUINOJSON_VERSION_MAJOR == 6
   AsyncCallbackJsonWebHandler(AsyncURIMatcher uri, ArJsonRequestHandlerFunction onRequest = nullptr, size_t maxJsonBufferSize = DYNAMIC_JSON_DOCUMENT_SIZE);
@@ -114,6 +138,19 @@ public:
   void onRequest(ArJsonRequestHandlerFunction fn) {
     _onRequest = fn;
   }
+#if ARDUINOJSON_VERSION_MAJOR >= 6
+  /**
+   * @brief only keep the body fields selected by @p filter in the document passed to the request callback,
+   * see ArduinoJson's DeserializationOption::Filter. The filter is copied, a null filter disables filtering.
+   */
+  void setFilter(JsonVariantConst filter) {
+#if ARDUINOJSON_VERSION_MAJOR == 6
+    _filter = filter;
+#else
+    _filter.set(filter);
+#endif
+  }
+#endif
 
   bool canHandle(AsyncWebServerRequest *request) const final;
   void handleRequest(AsyncWebServerRequest *request) final;
@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright 2016-2026 Hristo Gochkov, Mathieu Carbou, Emil Muratov, Will Miles
+
+#include "AsyncRingBuffer.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+
+// smallest allocation, avoids a series of tiny reallocations for short spills
+#define ASYNC_RING_BUFFER_MIN_CAPACITY 64
+
+bool AsyncRingBuffer::_reserve(size_t size) {
+  if (size <= _capacity) {
+    return true;
+  }
+  if (size > _maxSize) {
+    return false;
+  }
+
+  size_t capacity = std::max(std::max(size, _capacity * 2), (size_t)ASYNC_RING_BUFFER_MIN_CAPACITY);
+  capacity = std::min(capacity, _maxSize);
+
+  uint8_t *buffer = new (std::nothrow) uint8_t[capacity];
+  if (!buffer) {
+    return false;
+  }
+
+  // linearize the stored data at the beginning of the new storage
+  peek(buffer, _len);
+  _buffer.reset(buffer);
+  _capacity = capacity;
+  _head = 0;
+  return true;
+}
+
+void AsyncRingBuffer::_copyIn(size_t pos, const uint8_t *data, size_t len) {
+  const size_t first = std::min(len, _capacity - pos);
+  memcpy(_buffer.get() + pos, data, first);
+  memcpy(_buffer.get(), data + first, len - first);
+}
+
+size_t AsyncRingBuffer::peek(uint8_t *data, size_t len) const {
+  len = std::min(len, _len);
+  if (len) {
+    const size_t first = std::min(len, _capacity - _head);
+    memcpy(data, _buffer.get() + _head, first);
+    memcpy(data + first, _buffer.get(), len - first);
+  }
+  return len;
+}
+
+size_t AsyncRingBuffer::remove(size_t len) {
+  len = std::min(len, _len);
+  _len -= len;
+  _head = _len ? (_head + len) % _capacity : 0;
+  return len;
+}
+
+size_t AsyncRingBuffer::read(uint8_t *data, size_t len) {
+  return remove(peek(data, len));
+}
+
+size_t AsyncRingBuffer::append(const uint8_t *data, size_t len) {
+  len = std::min(len, room());
+  if (!len || !_reserve(_len + len)) {
+    return 0;
+  }
+  _copyIn((_head + _len) % _capacity, data, len);
+  _len += len;
+  return len;
+}
+
+size_t AsyncRingBuffer::prepend(const uint8_t *data, size_t len) {
+  len = std::min(len, room());
+  if (!len || !_reserve(_len + len)) {
+    return 0;
+  }
+  _head = (_head + _capacity - len) % _capacity;
+  _copyIn(_head, data, len);
+  _len += len;
+  return len;
+}
+
+void AsyncRingBuffer::clear() {
+  _buffer.reset();
+  _capacity = _head = _len = 0;
+}
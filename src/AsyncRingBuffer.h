@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright 2016-2026 Hristo Gochkov, Mathieu Carbou, Emil Muratov, Will Miles
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+
+/**
+ * @brief Growable byte ring buffer with a hard upper bound
+ * Bytes can be consumed from the front and added at either end without moving the data already stored,
+ * so draining a large spill in small pieces costs O(n) in total instead of O(n²) with vector::erase().
+ * Storage is allocated lazily on the first write and grows geometrically up to the configured max size.
+ */
+class AsyncRingBuffer {
+private:
+  std::unique_ptr<uint8_t[]> _buffer;
+  size_t _capacity{0};
+  size_t _head{0};
+  size_t _len{0};
+  size_t _maxSize;
+
+  // make sure at least @p size bytes could be stored, returns false if the limit is reached or allocation failed
+  bool _reserve(size_t size);
+  // copy @p len bytes to the ring starting at physical position @p pos (wrapping around)
+  void _copyIn(size_t pos, const uint8_t *data, size_t len);
+
+public:
+  explicit AsyncRingBuffer(size_t maxSize) : _maxSize(maxSize) {}
+
+  size_t size() const {
+    return _len;
+  }
+  bool empty() const {
+    return _len == 0;
+  }
+  size_t maxSize() const {
+    return _maxSize;
+  }
+  // num of bytes that could still be added before reaching the max size
+  size_t room() const {
+    return _maxSize - _len;
+  }
+
+  /**
+   * @brief copy up to @p len bytes from the front of the buffer to @p data and discard them
+   *
+   * @return size_t number of bytes read
+   */
+  size_t read(uint8_t *data, size_t len);
+
+  /**
+   * @brief copy up to @p len bytes from the front of the buffer without discarding them
+   *
+   * @return size_t number of bytes copied
+   */
+  size_t peek(uint8_t *data, size_t len) const;
+
+  /**
+   * @brief discard up to @p len bytes from the front of the buffer
+   *
+   * @return size_t number of bytes discarded
+   */
+  size_t remove(size_t len);
+
+  /**
+   * @brief add bytes after the data already stored
+   * @note if max size is reached only the leading part of @p data is stored
+   *
+   * @return size_t number of bytes stored
+   */
+  size_t append(const uint8_t *data, size_t len);
+
+  /**
+   * @brief add bytes in front of the data already stored, i.e. they will be read first
+   * @note if max size is reached only the leading part of @p data is stored
+   *
+   * @return size_t number of bytes stored
+   */
+  size_t prepend(const uint8_t *data, size_t len);
+
+  // discard all data and release the storage
+  void clear();
+};
@@ -0,0 +1,236 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright 2016-2026 Hristo Gochkov, Mathieu Carbou, Emil Muratov, Will Miles
+
+#pragma once
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <iterator>
+#include <new>
+#include <utility>
+
+/**
+ * @brief Queue of objects stored in a ring, without the per-element allocation of std::list or the chunk allocations of std::deque
+ * The storage for the expected num of elements is allocated once, on the first insertion or with reserve(), and kept when the queue is cleared,
+ * so a queue reused over and over does not allocate. It only grows, geometrically, if more elements are stored.
+ */
+template <typename T> class AsyncRingQueue {
+private:
+  T *_items{nullptr};
+  // capacity of _items, or capacity allocated on the first insertion while _items is null
+  size_t _capacity;
+  size_t _head{0};
+  size_t _len{0};
+
+  T *_at(size_t i) const {
+    return _items + (_head + i) % _capacity;
+  }
+
+  // make sure @p size elements could be stored, returns false if allocation failed
+  bool _reserve(size_t size) {
+    if (_items && size <= _capacity) {
+      return true;
+    }
+    const size_t capacity = _items ? std::max(size, _capacity * 2) : std::max(size, _capacity);
+    T *items = static_cast<T *>(::operator new(capacity * sizeof(T), std::nothrow));
+    if (!items) {
+      return false;
+    }
+    // move the stored elements at the beginning of the new storage
+    for (size_t i = 0; i < _len; i++) {
+      new (items + i) T(std::move(*_at(i)));
+      _at(i)->~T();
+    }
+    ::operator delete(_items);
+    _items = items;
+    _capacity = capacity;
+    _head = 0;
+    return true;
+  }
+
+public:
+  template <typename Q, typename V> class basic_iterator {
+    friend AsyncRingQueue;
+
+  private:
+    Q *_queue;
+    size_t _index;
+
+  public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef V value_type;
+    typedef ptrdiff_t difference_type;
+    typedef V *pointer;
+    typedef V &reference;
+
+    basic_iterator(Q *queue, size_t index) : _queue(queue), _index(index) {}
+
+    reference operator*() const {
+      return (*_queue)[_index];
+    }
+    pointer operator->() const {
+      return &(*_queue)[_index];
+    }
+    basic_iterator &operator++() {
+      ++_index;
+      return *this;
+    }
+    basic_iterator operator++(int) {
+      basic_iterator i = *this;
+      ++_index;
+      return i;
+    }
+    basic_iterator &operator--() {
+      --_index;
+      return *this;
+    }
+    basic_iterator operator--(int) {
+      basic_iterator i = *this;
+      --_index;
+      return i;
+    }
+    bool operator==(const basic_iterator &other) const {
+      return _index == other._index;
+    }
+    bool operator!=(const basic_iterator &other) const {
+      return _index != other._index;
+    }
+  };
+  typedef basic_iterator<AsyncRingQueue, T> iterator;
+  typedef basic_iterator<const AsyncRingQueue, const T> const_iterator;
+
+  /**
+   * @param capacity num of elements the storage is allocated for on the first insertion
+   */
+  explicit AsyncRingQueue(size_t capacity = 0) : _capacity(capacity) {}
+  AsyncRingQueue(const AsyncRingQueue &) = delete;
+  AsyncRingQueue &operator=(const AsyncRingQueue &) = delete;
+  // the storage is moved along with the elements
+  AsyncRingQueue(AsyncRingQueue &&other) : _items(other._items), _capacity(other._capacity), _head(other._head), _len(other._len) {
+    other._items = nullptr;
+    other._head = other._len = 0;
+  }
+  AsyncRingQueue &operator=(AsyncRingQueue &&other) {
+    if (this != &other) {
+      clear();
+      ::operator delete(_items);
+      _items = other._items;
+      _capacity = other._capacity;
+      _head = other._head;
+      _len = other._len;
+      other._items = nullptr;
+      other._head = other._len = 0;
+    }
+    return *this;
+  }
+  ~AsyncRingQueue() {
+    clear();
+    ::operator delete(_items);
+  }
+
+  size_t size() const {
+    return _len;
+  }
+  bool empty() const {
+    return _len == 0;
+  }
+  // num of elements that can be stored without allocating
+  size_t capacity() const {
+    return _items ? _capacity : 0;
+  }
+  // allocate the storage now, for at least @p size elements, returns false if allocation failed
+  bool reserve(size_t size) {
+    return _reserve(std::max(size, _capacity));
+  }
+
+  T &operator[](size_t i) {
+    return *_at(i);
+  }
+  const T &operator[](size_t i) const {
+    return *_at(i);
+  }
+  T &front() {
+    return *_at(0);
+  }
+  const T &front() const {
+    return *_at(0);
+  }
+  T &back() {
+    return *_at(_len - 1);
+  }
+  const T &back() const {
+    return *_at(_len - 1);
+  }
+
+  iterator begin() {
+    return iterator(this, 0);
+  }
+  iterator end() {
+    return iterator(this, _len);
+  }
+  const_iterator begin() const {
+    return const_iterator(this, 0);
+  }
+  const_iterator end() const {
+    return const_iterator(this, _len);
+  }
+
+  /**
+   * @brief construct an element at the end of the queue
+   *
+   * @return false if the storage had to grow and allocation failed
+   */
+  template <typename... Args> bool emplace_back(Args &&...args) {
+    if (!_reserve(_len + 1)) {
+      return false;
+    }
+    new (_at(_len)) T(std::forward<Args>(args)...);
+    _len++;
+    return true;
+  }
+
+  /**
+   * @brief construct an element before @p pos, the following elements are moved by one place
+   *
+   * @return false if the storage had to grow and allocation failed
+   */
+  template <typename... Args> bool emplace(iterator pos, Args &&...args) {
+    const size_t index = pos._index;
+    if (!emplace_back(std::forward<Args>(args)...)) {
+      return false;
+    }
+    for (size_t i = _len - 1; i > index; i--) {
+      std::swap(*_at(i), *_at(i - 1));
+    }
+    return true;
+  }
+
+  void pop_front() {
+    _at(0)->~T();
+    _len--;
+    _head = _len ? (_head + 1) % _capacity : 0;
+  }
+  void pop_back() {
+    _at(_len - 1)->~T();
+    _len--;
+  }
+
+  // remove the element at @p pos, the following elements are moved by one place, returns the iterator to the element following it
+  iterator erase(iterator pos) {
+    const size_t index = pos._index;
+    for (size_t i = index; i + 1 < _len; i++) {
+      *_at(i) = std::move(*_at(i + 1));
+    }
+    pop_back();
+    return iterator(this, index);
+  }
+
+  // destroy all the elements, the storage is kept
+  void clear() {
+    while (_len) {
+      pop_back();
+    }
+    _head = 0;
+  }
+};
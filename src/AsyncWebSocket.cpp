@@ -2,6 +2,7 @@
 // Copyright 2016-2026 Hristo Gochkov, Mathieu Carbou, Emil Muratov, Will Miles
 
 #include "AsyncWebSocket.h"
+#include "AsyncWebSocketDeflate.h"
 #include "AsyncWebServerLogging.h"
 
 #include <libb64/cencode.h>
@@ -25,6 +26,12 @@
 #endif
 
 #include <algorithm>
+#if ASYNCWEBSERVER_USE_MUTEX
+#include <atomic>
+#endif
+#if ASYNCWEBSERVER_USE_MUTEX && !defined(ESP32)
+#include <thread>
+#endif
 #include <cstdio>
 #include <cstring>
 #include <memory>
@@ -37,6 +44,89 @@
 
 using namespace asyncsrv;
 
+#if ASYNCWEBSERVER_USE_MUTEX
+#if defined(ESP32)
+typedef TaskHandle_t ws_task_t;
+static ws_task_t webSocketCurrentTask() {
+  return xTaskGetCurrentTaskHandle();
+}
+#else
+typedef std::thread::id ws_task_t;
+static ws_task_t webSocketCurrentTask() {
+  return std::this_thread::get_id();
+}
+#endif
+
+// task running the AsyncTCP callbacks, recorded when a client connects: acks cannot be processed while it waits
+static std::atomic<ws_task_t> webSocketTcpTask{};
+// num of WebSocketNoWaitScope of the current task
+static thread_local uint8_t webSocketNoWait = 0;
+
+// sends made in this scope do not wait for room with WS_QUEUE_BLOCK, used while holding _ws_clients_lock:
+// the AsyncTCP task and every other sender would wait as well
+class WebSocketNoWaitScope {
+public:
+  WebSocketNoWaitScope() {
+    webSocketNoWait++;
+  }
+  ~WebSocketNoWaitScope() {
+    webSocketNoWait--;
+  }
+};
+
+// true if the current task can wait for acks with WS_QUEUE_BLOCK
+static bool webSocketCanWait() {
+  return !webSocketNoWait && webSocketCurrentTask() != webSocketTcpTask.load();
+}
+#else
+class WebSocketNoWaitScope {
+public:
+  WebSocketNoWaitScope() {}
+};
+#endif
+
+#if defined(HOST) && defined(__GNUC__)
+// 16 bytes at a time, the compiler maps this vector type to SIMD registers (SSE, NEON)
+typedef uint32_t ws_mask_word_t __attribute__((vector_size(16)));
+#elif UINTPTR_MAX > 0xFFFFFFFF
+typedef uint64_t ws_mask_word_t;
+#else
+typedef uint32_t ws_mask_word_t;
+#endif
+
+// XOR @p len bytes of @p data with the 4 bytes @p mask key, @p offset is the position of data[0] in the frame payload
+static void webSocketMask(uint8_t *data, size_t len, const uint8_t *mask, size_t offset) {
+  size_t i = 0;
+  // leading bytes, until data is aligned on a word boundary
+  for (; i < len && (reinterpret_cast<uintptr_t>(data + i) % sizeof(ws_mask_word_t)); i++) {
+    data[i] ^= mask[(offset + i) & 3];
+  }
+
+  if (len - i >= sizeof(ws_mask_word_t)) {
+    // rotate the key once to the position of the first aligned byte and repeat it over a whole word
+    uint8_t key[sizeof(ws_mask_word_t)];
+    for (size_t k = 0; k < sizeof(key); k++) {
+      key[k] = mask[(offset + i + k) & 3];
+    }
+    ws_mask_word_t word;
+    memcpy(&word, key, sizeof(word));
+
+    // the words are aligned: memcpy() compiles to single loads and stores, without breaking strict aliasing
+    for (; len - i >= sizeof(ws_mask_word_t); i += sizeof(ws_mask_word_t)) {
+      uint8_t *p = static_cast<uint8_t *>(__builtin_assume_aligned(data + i, sizeof(ws_mask_word_t)));
+      ws_mask_word_t value;
+      memcpy(&value, p, sizeof(value));
+      value ^= word;
+      memcpy(p, &value, sizeof(value));
+    }
+  }
+
+  // trailing bytes
+  for (; i < len; i++) {
+    data[i] ^= mask[(offset + i) & 3];
+  }
+}
+
 size_t webSocketSendFrameWindow(AsyncClient *client) {
   if (!client || !client->canSend()) {
     return 0;
@@ -48,90 +138,126 @@ size_t webSocketSendFrameWindow(AsyncClient *client) {
   return space - 8;
 }
 
-size_t webSocketSendFrame(AsyncClient *client, bool final, uint8_t opcode, bool mask, uint8_t *data, size_t len) {
+// payloads up to this size are copied after the frame header and added to the TCP buffer at once
+#define WS_FRAME_MERGE_SIZE 128
+
+// add a frame to the TCP buffer, it is pushed by the caller with client->send() once all the frames that fit are added
+size_t webSocketSendFrame(AsyncClient *client, bool final, uint8_t opcode, bool mask, const uint8_t *data, size_t len, bool deflated = false) {
   if (!client || !client->canSend()) {
-    // Serial.println("SF 1");
     return 0;
   }
   size_t space = client->space();
   if (space < 2) {
-    // Serial.println("SF 2");
     return 0;
   }
-  uint8_t mbuf[4] = {0, 0, 0, 0};
-  uint8_t headLen = 2;
-  if (len && mask) {
-    headLen += 4;
-    mbuf[0] = rand() % 0xFF;  // NOLINT(runtime/threadsafe_fn)
-    mbuf[1] = rand() % 0xFF;  // NOLINT(runtime/threadsafe_fn)
-    mbuf[2] = rand() % 0xFF;  // NOLINT(runtime/threadsafe_fn)
-    mbuf[3] = rand() % 0xFF;  // NOLINT(runtime/threadsafe_fn)
-  }
-  if (len > 125) {
-    headLen += 2;
+  // frames are limited to the 16 bits payload length encoding
+  if (len > 0xFFFF) {
+    len = 0xFFFF;
   }
+  uint8_t headLen = 2 + ((len && mask) ? 4 : 0) + (len > 125 ? 2 : 0);
   if (space < headLen) {
-    // Serial.println("SF 2");
     return 0;
   }
-  space -= headLen;
-
-  if (len > space) {
-    len = space;
-  }
-
-  uint8_t *buf = (uint8_t *)malloc(headLen);
-  if (buf == NULL) {
-    async_ws_log_e("Failed to allocate");
-    client->abort();
-    return 0;
+  if (len > space - headLen) {
+    len = space - headLen;
+    headLen = 2 + ((len && mask) ? 4 : 0) + (len > 125 ? 2 : 0);
   }
 
-  buf[0] = opcode & 0x0F;
+  // header (at most 8 bytes) and small payloads are assembled on the stack
+  uint8_t frame[8 + WS_FRAME_MERGE_SIZE];
+  frame[0] = opcode & 0x0F;
   if (final) {
-    buf[0] |= 0x80;
+    frame[0] |= 0x80;
+  }
+  // RSV1 flags the first frame of a compressed message
+  if (deflated) {
+    frame[0] |= 0x40;
   }
   if (len < 126) {
-    buf[1] = len & 0x7F;
+    frame[1] = len;
   } else {
-    buf[1] = 126;
-    buf[2] = (uint8_t)((len >> 8) & 0xFF);
-    buf[3] = (uint8_t)(len & 0xFF);
+    frame[1] = 126;
+    frame[2] = (uint8_t)((len >> 8) & 0xFF);
+    frame[3] = (uint8_t)(len & 0xFF);
   }
+  // the masking key follows the payload length
+  uint8_t *key = frame + (len > 125 ? 4 : 2);
   if (len && mask) {
-    buf[1] |= 0x80;
-    memcpy(buf + (headLen - 4), mbuf, 4);
-  }
-  if (client->add((const char *)buf, headLen) != headLen) {
-    // os_printf("error adding %lu header bytes\n", headLen);
-    free(buf);
-    // Serial.println("SF 4");
-    return 0;
+    frame[1] |= 0x80;
+    const uint32_t random = ((uint32_t)rand() << 16) ^ (uint32_t)rand();  // NOLINT(runtime/threadsafe_fn)
+    memcpy(key, &random, 4);
   }
-  free(buf);
 
-  if (len) {
-    if (len && mask) {
-      size_t i;
-      for (i = 0; i < len; i++) {
-        data[i] = data[i] ^ mbuf[i % 4];
+  if (len <= WS_FRAME_MERGE_SIZE) {
+    if (len) {
+      memcpy(frame + headLen, data, len);
+      if (mask) {
+        webSocketMask(frame + headLen, len, key, 0);
       }
     }
-    if (client->add((const char *)data, len) != len) {
-      // os_printf("error adding %lu data bytes\n", len);
-      //  Serial.println("SF 5");
+    if (client->add((const char *)frame, headLen + len) != headLen + len) {
       return 0;
     }
+  } else {
+    if (client->add((const char *)frame, headLen) != headLen) {
+      return 0;
+    }
+    if (!mask) {
+      if (client->add((const char *)data, len) != len) {
+        return 0;
+      }
+    } else {
+      // masked chunk by chunk after the header on the stack, the payload may be shared with other clients and is left unchanged
+      uint8_t *chunk = frame + 8;
+      for (size_t i = 0; i < len; i += WS_FRAME_MERGE_SIZE) {
+        const size_t chunkLen = std::min(len - i, (size_t)WS_FRAME_MERGE_SIZE);
+        memcpy(chunk, data + i, chunkLen);
+        webSocketMask(chunk, chunkLen, key, i);
+        if (client->add((const char *)chunk, chunkLen) != chunkLen) {
+          return 0;
+        }
+      }
+    }
   }
-  if (!client->send()) {
-    // os_printf("error sending frame: %lu\n", headLen+len);
-    //  Serial.println("SF 6");
-    return 0;
-  }
-  // Serial.println("SF");
   return len;
 }
 
+// size of the header of an unmasked frame of @p len bytes
+static size_t webSocketFrameHeaderLength(size_t len) {
+  return len < 126 ? 2 : (len <= 0xFFFF ? 4 : 10);
+}
+
+// write the header of an unmasked frame of @p len bytes, any length, to @p buf (10 bytes at most)
+static size_t webSocketFrameHeader(uint8_t *buf, uint8_t firstByte, size_t len) {
+  buf[0] = firstByte;
+  if (len < 126) {
+    buf[1] = len;
+  } else if (len <= 0xFFFF) {
+    buf[1] = 126;
+    buf[2] = (uint8_t)((len >> 8) & 0xFF);
+    buf[3] = (uint8_t)(len & 0xFF);
+  } else {
+    buf[1] = 127;
+    for (size_t i = 0; i < 8; i++) {
+      buf[2 + i] = (uint8_t)(((uint64_t)len >> (8 * (7 - i))) & 0xFF);
+    }
+  }
+  return webSocketFrameHeaderLength(len);
+}
+
+// build a complete unmasked frame holding the whole payload, to be shared by all the clients a message is broadcast to
+static AsyncWebSocketSharedBuffer webSocketEncodeFrame(uint8_t opcode, bool deflated, const uint8_t *data, size_t len) {
+  const size_t headLen = webSocketFrameHeaderLength(len);
+  auto frame = std::make_shared<std::vector<uint8_t>>(headLen + len);
+  if (frame->size() != headLen + len) {
+    return nullptr;
+  }
+  uint8_t *buf = frame->data();
+  webSocketFrameHeader(buf, 0x80 | (opcode & 0x0F) | (deflated ? 0x40 : 0), len);
+  memcpy(buf + headLen, data, len);
+  return frame;
+}
+
 size_t AsyncWebSocketControl::send(AsyncClient *client) {
   _finished = true;
   return webSocketSendFrame(client, true, _opcode & 0x0F, _mask, _data, _len);
@@ -167,18 +293,21 @@ bool AsyncWebSocketMessageBuffer::reserve(size_t size) {
  * AsyncWebSocketMessage Message
  */
 
-AsyncWebSocketMessage::AsyncWebSocketMessage(AsyncWebSocketSharedBuffer buffer, uint8_t opcode, bool mask)
-  : _WSbuffer{buffer}, _opcode(opcode & 0x07), _mask{mask}, _status{_WSbuffer ? WS_MSG_SENDING : WS_MSG_ERROR} {}
+AsyncWebSocketMessage::AsyncWebSocketMessage(AsyncWebSocketSharedBuffer buffer, uint8_t opcode, bool mask, bool deflated, bool encoded)
+  : _WSbuffer{buffer}, _opcode(opcode & 0x07), _mask{mask}, _status{_WSbuffer ? WS_MSG_SENDING : WS_MSG_ERROR}, _deflated{deflated}, _encoded{encoded} {}
+
+AsyncWebSocketMessage::AsyncWebSocketMessage(AwsResponseFiller filler, size_t len, uint8_t opcode)
+  : _opcode(opcode & 0x07), _status{filler ? WS_MSG_SENDING : WS_MSG_ERROR}, _filler{std::move(filler)}, _streamLength{len} {}
 
 size_t AsyncWebSocketMessage::ack(size_t len, uint32_t time) {
   (void)time;
   const size_t pending = std::min(len, _ack - _acked);
   _acked += pending;
-  if (_sent >= _WSbuffer->size() && _acked >= _ack) {
+  if (!_remainingBytesToSend() && _acked >= _ack) {
     _status = WS_MSG_SENT;
   }
   const size_t remaining = len - pending;
-  async_ws_log_v("ACK[%" PRIu8 "] %u/%u (acked: %u/%u) => %" PRIu8, _opcode, _sent, _WSbuffer->size(), _acked, _ack, static_cast<uint8_t>(_status));
+  async_ws_log_v("ACK[%" PRIu8 "] %u/%u (acked: %u/%u) => %" PRIu8, _opcode, _sent, _length(), _acked, _ack, static_cast<uint8_t>(_status));
   return remaining;
 }
 
@@ -193,6 +322,10 @@ size_t AsyncWebSocketMessage::send(AsyncClient *client) {
     return 0;
   }
 
+  if (_filler) {
+    return _sendStream(client);
+  }
+
   if (_sent == _WSbuffer->size()) {
     if (_acked == _ack) {
       _status = WS_MSG_SENT;
@@ -208,6 +341,10 @@ size_t AsyncWebSocketMessage::send(AsyncClient *client) {
     return 0;
   }
 
+  if (_encoded) {
+    return _sendEncoded(client);
+  }
+
   size_t toSend = _WSbuffer->size() - _sent;
   const size_t window = webSocketSendFrameWindow(client);
 
@@ -226,7 +363,7 @@ size_t AsyncWebSocketMessage::send(AsyncClient *client) {
   uint8_t *dPtr = (uint8_t *)(_WSbuffer->data() + (_sent - toSend));
   uint8_t opCode = (toSend && _sent == toSend) ? _opcode : (uint8_t)WS_CONTINUATION;
 
-  size_t sent = webSocketSendFrame(client, final, opCode, _mask, dPtr, toSend);
+  size_t sent = webSocketSendFrame(client, final, opCode, _mask, dPtr, toSend, _deflated && opCode != WS_CONTINUATION);
   _status = WS_MSG_SENDING;
   if (toSend && sent != toSend) {
     _sent -= (toSend - sent);
@@ -239,6 +376,115 @@ size_t AsyncWebSocketMessage::send(AsyncClient *client) {
   return sent;
 }
 
+size_t AsyncWebSocketMessage::_sendEncoded(AsyncClient *client) {
+  if (!client->canSend() || !client->space()) {
+    async_ws_log_v("SEND[%" PRIu8 "] => [%" PRIu16 "] NO_SPACE %u", _opcode, client->remotePort(), _remainingBytesToSend());
+    return 0;
+  }
+
+  // the frame is already complete: the TCP buffer is filled with as many bytes as it can take, regardless of frame boundaries
+  const size_t toSend = std::min(_remainingBytesToSend(), client->space());
+  const size_t sent = client->add((const char *)(_WSbuffer->data() + _sent), toSend);
+  if (!sent) {
+    return 0;
+  }
+  // bytes added to the TCP buffer will be acked even if they cannot be pushed right now
+  _sent += sent;
+  _ack += sent;
+
+  async_ws_log_v(
+    "SEND[%" PRIu8 "] => [%" PRIu16 "] WS_MSG_SENDING %u/%u (acked: %u/%u)", _opcode, client->remotePort(), _sent, _WSbuffer->size(), _acked, _ack
+  );
+  return sent;
+}
+
+size_t AsyncWebSocketMessage::_sendStream(AsyncClient *client) {
+  const size_t space = client->canSend() ? client->space() : 0;
+  // frame header, and the final empty fragment of a message of unknown length
+  const size_t headLen = (_streamLength && _headerSent) ? 0 : (_streamLength ? webSocketFrameHeaderLength(_streamLength) : 4);
+  if (space <= headLen + 2) {
+    async_ws_log_v("SEND[%" PRIu8 "] => [%" PRIu16 "] NO_SPACE", _opcode, client->remotePort());
+    return 0;
+  }
+
+  if (!_chunk) {
+    _chunkSize = _streamLength ? std::min(_streamLength, (size_t)WS_STREAM_CHUNK_SIZE) : WS_STREAM_CHUNK_SIZE;
+    _chunk.reset(new (std::nothrow) uint8_t[_chunkSize]);
+    if (!_chunk) {
+      async_ws_log_e("Failed to allocate");
+      return 0;
+    }
+  }
+
+  size_t toSend = std::min(space - headLen - 2, _chunkSize);
+  if (_streamLength) {
+    toSend = std::min(toSend, _streamLength - _sent);
+  } else {
+    toSend = std::min(toSend, (size_t)0xFFFF);
+  }
+
+  size_t len = 0;
+  if (!_streamFailed) {
+    len = _filler(_chunk.get(), toSend, _sent);
+    if (len == RESPONSE_TRY_AGAIN) {
+      return 0;
+    }
+    len = std::min(len, toSend);
+  }
+
+  size_t added = 0;
+  if (_streamLength) {
+    if (!len) {
+      // the frame length was announced: it can only be completed with padding
+      if (!_streamFailed) {
+        async_ws_log_w(
+          "SEND[%" PRIu8 "] => [%" PRIu16 "] stream ended at %" PRIu32 "/%" PRIu32, _opcode, client->remotePort(), static_cast<uint32_t>(_sent),
+          static_cast<uint32_t>(_streamLength)
+        );
+        _streamFailed = true;
+      }
+      len = toSend;
+      memset(_chunk.get(), 0, len);
+    }
+    if (!_headerSent) {
+      uint8_t header[10];
+      webSocketFrameHeader(header, 0x80 | _opcode, _streamLength);
+      if (client->add((const char *)header, headLen) != headLen) {
+        return 0;
+      }
+      // not written again if the payload cannot be added now
+      _headerSent = true;
+      added += headLen;
+    }
+    const size_t payload = client->add((const char *)_chunk.get(), len);
+    // the rest of the frame is padded if the produced data could not be added
+    _streamFailed |= payload != len;
+    added += payload;
+    _sent += payload;
+    _ack += added;
+  } else {
+    const uint8_t opcode = _sent ? (uint8_t)WS_CONTINUATION : _opcode;
+    // fragments are sent until the producer returns 0, then an empty final fragment ends the message
+    const size_t sent = webSocketSendFrame(client, !len, opcode, false, _chunk.get(), len);
+    if (len && sent != len) {
+      async_ws_log_e("SEND[%" PRIu8 "] => [%" PRIu16 "] failed to send fragment", _opcode, client->remotePort());
+      _status = WS_MSG_ERROR;
+      return 0;
+    }
+    added = len + (len < 126 ? 2 : 4);
+    _sent += len;
+    _ack += added;
+    _streamDone = !len;
+  }
+
+  if (!_remainingBytesToSend()) {
+    _chunk.reset();
+  }
+
+  async_ws_log_v("SEND[%" PRIu8 "] => [%" PRIu16 "] WS_MSG_SENDING %u/%u (acked: %u/%u)", _opcode, client->remotePort(), _sent, _streamLength, _acked, _ack);
+  return added;
+}
+
 /*
  * Async WebSocket Client
  */
@@ -247,7 +493,7 @@ const size_t AWSC_PING_PAYLOAD_LEN = 22;
 
 AsyncWebSocketClient::AsyncWebSocketClient(AsyncClient *client, AsyncWebSocket *server)
   : _client(client), _server(server), _clientId(_server->_getNextId()), _status(WS_CONNECTED), _pstate(STATE_FRAME_START), _lastMessageTime(millis()),
-    _keepAlivePeriod(0), _tempObject(NULL) {
+    _keepAlivePeriod(0), _lastActivity(_lastMessageTime), _lastDataTime(_lastMessageTime), _tempObject(NULL) {
 
   _client->setRxTimeout(0);
   _client->onError(
@@ -295,21 +541,112 @@ AsyncWebSocketClient::AsyncWebSocketClient(AsyncClient *client, AsyncWebSocket *
   memset(&_pinfo, 0, sizeof(_pinfo));
 }
 
+AsyncWebSocketClient::AsyncWebSocketClient(AsyncWebSocket *server)
+  : _client(nullptr), _server(server), _clientId(0), _status(WS_DISCONNECTED), _pstate(STATE_FRAME_START), _lastMessageTime(0), _keepAlivePeriod(0),
+    _lastActivity(0), _lastDataTime(0), _tempObject(NULL) {
+  memset(&_pinfo, 0, sizeof(_pinfo));
+}
+
 AsyncWebSocketClient::~AsyncWebSocketClient() {
+  // a free slot was never connected
+  if (!_clientId) {
+    return;
+  }
   {
     asyncsrv::lock_guard_type lock(_queue_lock);
+    _messageDequeued(_queuedBytes);
     _messageQueue.clear();
     _controlQueue.clear();
   }
   _server->_handleEvent(this, WS_EVT_DISCONNECT, NULL, NULL, 0);
 }
 
+void AsyncWebSocketClient::_setStatus(AwsClientStatus status) {
+  asyncsrv::lock_guard_type lock(_server->_counters_lock);
+  if (_status == WS_CONNECTED && status != WS_CONNECTED) {
+    _server->_connectedClients--;
+  }
+  _status = status;
+}
+
 void AsyncWebSocketClient::_clearQueue() {
   while (!_messageQueue.empty() && _messageQueue.front().finished()) {
+    _messageDequeued(_messageQueue.front()._queuedSize());
     _messageQueue.pop_front();
   }
 }
 
+bool AsyncWebSocketClient::_queueHasRoom(size_t len, bool newMessage) const {
+  if (newMessage && _messageQueue.size() >= WS_MAX_QUEUED_MESSAGES) {
+    return false;
+  }
+  // a message bigger than the budget is accepted when nothing else is queued, it would never be sent otherwise
+  if (_server->_maxQueuedBytes && _queuedBytes && _queuedBytes + len > _server->_maxQueuedBytes) {
+    return false;
+  }
+  if (_server->_maxQueuedBytesTotal) {
+    asyncsrv::lock_guard_type lock(_server->_counters_lock);
+    if (_server->_queuedBytes && _server->_queuedBytes + len > _server->_maxQueuedBytesTotal) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void AsyncWebSocketClient::_messageQueued(size_t len) {
+  _queuedBytes += len;
+  asyncsrv::lock_guard_type lock(_server->_counters_lock);
+  _server->_queuedBytes += len;
+}
+
+void AsyncWebSocketClient::_messageDequeued(size_t len) {
+  _queuedBytes -= len;
+  asyncsrv::lock_guard_type lock(_server->_counters_lock);
+  _server->_queuedBytes -= len;
+}
+
+bool AsyncWebSocketClient::_dropOldestMessage() {
+  // messages are sent in order: the ones not started yet are at the end of the queue
+  for (auto i = _messageQueue.begin(); i != _messageQueue.end(); ++i) {
+    if (!i->_started()) {
+      async_ws_log_w(
+        "[%s][%" PRIu32 "] Queue full: discarding oldest message (%" PRIu32 " bytes)", _server->url(), _clientId, static_cast<uint32_t>(i->_length())
+      );
+      _messageDequeued(i->_queuedSize());
+      _messageQueue.erase(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+AsyncWebSocketMessage *AsyncWebSocketClient::_pendingLatest(uint32_t key) {
+  for (auto &msg : _messageQueue) {
+    if (msg._latest && msg._key == key && !msg._started()) {
+      return &msg;
+    }
+  }
+  return nullptr;
+}
+
+bool AsyncWebSocketClient::_checkWritable() {
+  if (!_writableWanted || _status != WS_CONNECTED || _messageQueue.size() > WS_MAX_QUEUED_MESSAGES / 2) {
+    return false;
+  }
+  const size_t lowWatermark = _server->_queueLowWatermark ? _server->_queueLowWatermark : _server->_maxQueuedBytes / 2;
+  if ((_server->_queueLowWatermark || _server->_maxQueuedBytes) && _queuedBytes > lowWatermark) {
+    return false;
+  }
+  if (_server->_maxQueuedBytesTotal) {
+    asyncsrv::lock_guard_type lock(_server->_counters_lock);
+    if (_server->_queuedBytes > _server->_maxQueuedBytesTotal / 2) {
+      return false;
+    }
+  }
+  _writableWanted = false;
+  return true;
+}
+
 void AsyncWebSocketClient::_onAck(size_t len, uint32_t time) {
   _lastMessageTime = millis();
 
@@ -317,13 +654,41 @@ void AsyncWebSocketClient::_onAck(size_t len, uint32_t time) {
 
   async_ws_log_v("[%s][%" PRIu32 "] START ACK(%u, %" PRIu32 ") Q:%u", _server->url(), _clientId, len, time, _messageQueue.size());
 
-  if (!_controlQueue.empty()) {
-    auto &head = _controlQueue.front();
-    if (head.finished()) {
-      len -= head.len();
-      if (_status == WS_DISCONNECTING && head.opcode() == WS_DISCONNECT) {
-        _controlQueue.pop_front();
-        _status = WS_DISCONNECTED;
+  // the first bytes acked are the handshake response, sent before the client took the connection over
+  if (_handshakeUnacked) {
+    const size_t handshake = std::min(len, _handshakeUnacked);
+    _handshakeUnacked -= handshake;
+    len -= handshake;
+  }
+
+  while (len && !_inFlight.empty()) {
+    InFlight &head = _inFlight.front();
+    const size_t acked = std::min(len, head.len);
+    head.len -= acked;
+    len -= acked;
+
+    if (head.kind == IN_FLIGHT_MESSAGE) {
+      size_t left = acked;
+      for (auto &msg : _messageQueue) {
+        left = msg.ack(left, time);
+        if (left == 0) {
+          break;
+        }
+      }
+    }
+
+    if (head.len) {
+      break;
+    }
+    const InFlightKind kind = head.kind;
+    _inFlight.pop_front();
+
+    // the control frames are sent in order: the first one is the one acked
+    if (kind == IN_FLIGHT_CONTROL && !_controlQueue.empty() && _controlQueue.front().finished()) {
+      const uint8_t opcode = _controlQueue.front().opcode();
+      _controlQueue.pop_front();
+      if (_status == WS_DISCONNECTING && opcode == WS_DISCONNECT) {
+        _setStatus(WS_DISCONNECTED);
         async_ws_log_v("[%s][%" PRIu32 "] ACK WS_DISCONNECTED", _server->url(), _clientId);
         // Capture _client before unlocking: _client->close() triggers the _onDisconnect() --> _handleDisconnect() --> ~AsyncWebSocketClient() chain,
         // so we must not access any member after unlock.
@@ -334,16 +699,6 @@ void AsyncWebSocketClient::_onAck(size_t len, uint32_t time) {
         }
         return;
       }
-      _controlQueue.pop_front();
-    }
-  }
-
-  if (len && !_messageQueue.empty()) {
-    for (auto &msg : _messageQueue) {
-      len = msg.ack(len, time);
-      if (len == 0) {
-        break;
-      }
     }
   }
 
@@ -352,17 +707,46 @@ void AsyncWebSocketClient::_onAck(size_t len, uint32_t time) {
   async_ws_log_v("[%s][%" PRIu32 "] END ACK(%u, %" PRIu32 ") Q:%u", _server->url(), _clientId, len, time, _messageQueue.size());
 
   _runQueue();
+
+  if (_closeCode) {
+    _closeOnError(lock);
+    return;
+  }
+
+  if (_checkWritable()) {
+    lock.unlock();
+    _server->_handleEvent(this, WS_EVT_WRITABLE, NULL, NULL, 0);
+  }
 }
 
 void AsyncWebSocketClient::_onPoll() {
+  AsyncWebSocket *server = _server;
+  _pollQueue();
+  // the keepalive may close any client, this one included: no member can be accessed afterwards
+  server->_runTimers();
+}
+
+void AsyncWebSocketClient::_pollQueue() {
   asyncsrv::unique_lock_type lock(_queue_lock);
 
   if (!_client) {
     return;
   }
 
-  if (_client && _client->canSend() && (!_controlQueue.empty() || !_messageQueue.empty())) {
+  if (_client && _client->canSend() && (!_controlQueue.empty() || !_messageQueue.empty() || _channel)) {
     _runQueue();
+  }
+
+  // a streamed message ended early and its frame is now complete, or channel frames were lost
+  if (_closeCode) {
+    _closeOnError(lock);
+    return;
+  }
+
+  // the global budget may also have been released by the other clients
+  if (_checkWritable()) {
+    lock.unlock();
+    _server->_handleEvent(this, WS_EVT_WRITABLE, NULL, NULL, 0);
   } else if (_keepAlivePeriod > 0 && (millis() - _lastMessageTime) >= _keepAlivePeriod && (_controlQueue.empty() && _messageQueue.empty())) {
     lock.unlock();
     ping((uint8_t *)AWSC_PING_PAYLOAD, AWSC_PING_PAYLOAD_LEN);
@@ -376,7 +760,16 @@ void AsyncWebSocketClient::_runQueue() {
   }
 
   _clearQueue();
+  _holding = false;
 
+  // room for the records of the frames that can be added below: a control frame each, then channel, message and channel bytes
+  if (!_inFlight.reserve(_inFlight.size() + _controlQueue.size() + 3)) {
+    async_ws_log_e("[%s][%" PRIu32 "] Failed to allocate in-flight queue", _server->url(), _clientId);
+    return;
+  }
+
+  // the frames are packed into the TCP buffer and pushed with a single send() at the end, instead of one TCP segment per frame
+  const size_t spaceBefore = _client->space();
   size_t space = webSocketSendFrameWindow(_client);
 
   if (space) {
@@ -385,32 +778,55 @@ void AsyncWebSocketClient::_runQueue() {
     // - there is no message frame in the queue, or the first message frame is between frames (all bytes sent are acked)
     // - the control frame is not finished (not sent yet)
     // - there is enough space to send the control frame (control frames are small, at most 129 bytes, so we can assume that if there is space to send it, it can be sent in one go)
-    if (_messageQueue.empty() || _messageQueue.front().betweenFrames()) {
+    if ((_messageQueue.empty() || _messageQueue.front().betweenFrames()) && !_channelFrameLeft) {
       for (auto &ctrl : _controlQueue) {
         if (ctrl.finished()) {
           continue;
         }
-        if (space > (size_t)(ctrl.len() - 1)) {
-          async_ws_log_v("[%s][%" PRIu32 "] SEND CTRL %" PRIu8, _server->url(), _clientId, ctrl.opcode());
-          ctrl.send(_client);
-          space = webSocketSendFrameWindow(_client);
+        // in order, the acks are credited to them in that order
+        if (space <= (size_t)(ctrl.len() - 1)) {
+          break;
         }
+        async_ws_log_v("[%s][%" PRIu32 "] SEND CTRL %" PRIu8, _server->url(), _clientId, ctrl.opcode());
+        const size_t before = _client->space();
+        ctrl.send(_client);
+        _addedInFlight(IN_FLIGHT_CONTROL, before - _client->space());
+        space = webSocketSendFrameWindow(_client);
       }
     }
 
+    const size_t spaceData = _client->space();
+
+    // a channel frame partially sent must be completed before any message frame
+    if (_channelFrameLeft && (!_channel || !_sendChannel())) {
+      space = 0;
+    }
+    _addedInFlight(IN_FLIGHT_CHANNEL, spaceData - _client->space());
+
     // then we can send message frames if there is space
+    if (space) {
+      space = webSocketSendFrameWindow(_client);
+    }
     if (space) {
       for (auto &msg : _messageQueue) {
         if (msg._remainingBytesToSend()) {
           async_ws_log_v(
-            "[%s][%" PRIu32 "][%" PRIu8 "] SEND %u/%u (acked: %u/%u)", _server->url(), _clientId, msg._opcode, msg._sent, msg._WSbuffer->size(), msg._acked,
+            "[%s][%" PRIu32 "][%" PRIu8 "] SEND %u/%u (acked: %u/%u)", _server->url(), _clientId, msg._opcode, msg._sent, msg._length(), msg._acked,
             msg._ack
           );
 
           // will use all the remaining space, or all the remaining bytes to send, whichever is smaller
+          _inProducer = (bool)msg._filler;
+          const size_t before = _client->space();
           msg.send(_client);
+          _addedInFlight(IN_FLIGHT_MESSAGE, before - _client->space());
+          _inProducer = false;
           space = webSocketSendFrameWindow(_client);
 
+          if (msg._streamFailed && !msg._remainingBytesToSend()) {
+            _closeCode = 1011;
+          }
+
           // If we haven't finished sending this message, we must stop here to preserve WebSocket ordering.
           // We can only pipeline subsequent messages if the current one is fully passed to TCP buffer.
           if (msg._remainingBytesToSend()) {
@@ -424,12 +840,136 @@ void AsyncWebSocketClient::_runQueue() {
         }
       }
     }
+
+    // and finally the channel frames, once all the messages are passed to the TCP buffer
+    if (_channel && !_channelFrameLeft && _status == WS_CONNECTED && (_messageQueue.empty() || !_messageQueue.back()._remainingBytesToSend())) {
+      const size_t before = _client->space();
+      _sendChannel();
+      _addedInFlight(IN_FLIGHT_CHANNEL, before - _client->space());
+    }
+
+    if (_client->space() != spaceData) {
+      _lastDataTime = millis();
+    }
+  }
+
+  if (_client->space() != spaceBefore) {
+    _client->send();
+  }
+}
+
+void AsyncWebSocketClient::_addedInFlight(InFlightKind kind, size_t len) {
+  if (!len) {
+    return;
+  }
+  if (kind != IN_FLIGHT_CONTROL && !_inFlight.empty() && _inFlight.back().kind == kind) {
+    _inFlight.back().len += len;
+    return;
+  }
+  // cannot fail, room was reserved by _runQueue()
+  _inFlight.emplace_back(kind, len);
+}
+
+bool AsyncWebSocketClient::_holdForBatch() {
+  // held only while the previous data is in flight: its ack runs the queue and sends the held messages at once
+  if (!_server->_flushDelay || _messageQueue.size() < 2 || _messageQueue.front()._acked == _messageQueue.front()._ack) {
+    return false;
+  }
+  if (!_holding) {
+    _holding = true;
+    _holdSince = millis();
+  }
+  return millis() - _holdSince < _server->_flushDelay;
+}
+
+bool AsyncWebSocketClient::_sendChannel() {
+  // all calls to this method MUST be protected by _queue_lock!
+  asyncsrv::lock_guard_type lock(_channel->_lock);
+
+  if (_channelCursor < _channel->_start) {
+    // the frames not sent yet were overwritten by newer ones
+    if (_channelFrameLeft || _channel->_lagPolicy == WS_CHANNEL_DISCONNECT) {
+      async_ws_log_w("[%s][%" PRIu32 "] CHANNEL frames lost, closing", _server->url(), _clientId);
+      _closeCode = 1008;
+      if (!_channelFrameLeft) {
+        _channelCursor = _channel->_end;
+      }
+      return !_channelFrameLeft;
+    }
+    async_ws_log_w(
+      "[%s][%" PRIu32 "] CHANNEL lagging, %" PRIu32 " bytes skipped", _server->url(), _clientId, static_cast<uint32_t>(_channel->_start - _channelCursor)
+    );
+    _channelCursor = _channel->_start;
+  }
+
+  while (_channelCursor < _channel->_end) {
+    if (!_channelFrameLeft) {
+      _channelFrameLeft = _channel->_frameSize(_channelCursor);
+    }
+    const size_t toAdd = std::min(_channelFrameLeft, _client->canSend() ? _client->space() : 0);
+    if (!toAdd) {
+      break;
+    }
+    const size_t n = _channel->_addTo(_client, _channelCursor, toAdd);
+    _channelCursor += n;
+    _channelFrameLeft -= n;
+    if (n < toAdd) {
+      break;
+    }
+  }
+  return !_channelFrameLeft;
+}
+
+void AsyncWebSocketClient::_flushChannel() {
+  asyncsrv::unique_lock_type lock(_queue_lock);
+  if (!_client || !_client->canSend()) {
+    return;
+  }
+  _runQueue();
+  if (_closeCode) {
+    _closeOnError(lock);
+  }
+}
+
+void AsyncWebSocketClient::_detachChannel() {
+  if (_channelFrameLeft && _channelCursor >= _channel->_start) {
+    // queued before the messages not sent yet: they were queued after the frame started
+    auto buffer = std::make_shared<std::vector<uint8_t>>(_channelFrameLeft);
+    if (buffer->size() == _channelFrameLeft) {
+      _channel->_copyOut(_channelCursor, buffer->data(), _channelFrameLeft);
+      const auto pos = std::find_if(_messageQueue.begin(), _messageQueue.end(), [](const AsyncWebSocketMessage &msg) {
+        return !msg._started() && msg._remainingBytesToSend();
+      });
+      if (_messageQueue.emplace(pos, buffer, WS_BINARY, false, false, true)) {
+        _messageQueued(buffer->size());
+        _channelFrameLeft = 0;
+      }
+    }
+  }
+  if (_channelFrameLeft) {
+    // the frame cannot be completed anymore: _closeOnError() closes the TCP connection
+    _closeCode = 1001;
+  }
+  _channel = nullptr;
+}
+
+void AsyncWebSocketClient::_closeOnError(asyncsrv::unique_lock_type &lock) {
+  const uint16_t code = _closeCode;
+  _closeCode = 0;
+  AsyncClient *c = _client;
+  const bool midFrame = _channelFrameLeft != 0;
+  lock.unlock();
+  if (!midFrame) {
+    close(code);
+  } else if (c) {
+    // a close frame would be read as the payload of the frame partially sent
+    c->close();
   }
 }
 
 bool AsyncWebSocketClient::queueIsFull() const {
   asyncsrv::lock_guard_type lock(_queue_lock);
-  return (_messageQueue.size() >= WS_MAX_QUEUED_MESSAGES) || (_status != WS_CONNECTED);
+  return !_queueHasRoom(1) || (_status != WS_CONNECTED);
 }
 
 size_t AsyncWebSocketClient::queueLen() const {
@@ -437,9 +977,14 @@ size_t AsyncWebSocketClient::queueLen() const {
   return _messageQueue.size();
 }
 
+size_t AsyncWebSocketClient::queuedBytes() const {
+  asyncsrv::lock_guard_type lock(_queue_lock);
+  return _queuedBytes;
+}
+
 bool AsyncWebSocketClient::canSend() const {
   asyncsrv::lock_guard_type lock(_queue_lock);
-  return _messageQueue.size() < WS_MAX_QUEUED_MESSAGES;
+  return _queueHasRoom(1);
 }
 
 bool AsyncWebSocketClient::_queueControl(uint8_t opcode, const uint8_t *data, size_t len, bool mask) {
@@ -449,26 +994,141 @@ bool AsyncWebSocketClient::_queueControl(uint8_t opcode, const uint8_t *data, si
     return false;
   }
 
-  _controlQueue.emplace_back(opcode, data, len, mask);
+  if (!_controlQueue.emplace_back(opcode, data, len, mask)) {
+    async_ws_log_e("[%s][%" PRIu32 "] Failed to allocate control queue", _server->url(), _clientId);
+    return false;
+  }
   async_ws_log_v("[%s][%" PRIu32 "] QUEUE CTRL (%u) << %" PRIu8, _server->url(), _clientId, _controlQueue.size(), opcode);
 
-  if (_client && _client->canSend()) {
+  // queued from a stream producer: sent by the _runQueue() in progress
+  if (_client && _client->canSend() && !_inProducer) {
     _runQueue();
   }
 
   return true;
 }
 
-bool AsyncWebSocketClient::_queueMessage(AsyncWebSocketSharedBuffer buffer, uint8_t opcode, bool mask) {
+bool AsyncWebSocketClient::_queueMessage(
+  AsyncWebSocketSharedBuffer buffer, uint8_t opcode, bool mask, AsyncWebSocketBroadcastBuffer *broadcast, bool latest, uint32_t key
+) {
+  // compress and encode before locking the queue, a broadcast only does it for the first client
+  bool compressed = false;
+  bool encoded = false;
+  if (_deflateWindowBits && buffer && buffer->size() >= _server->_deflateThreshold && ((opcode & 0x07) == WS_TEXT || (opcode & 0x07) == WS_BINARY)
+      && _status == WS_CONNECTED) {
+    AsyncWebSocketBroadcastBuffer local;
+    AsyncWebSocketBroadcastBuffer *cache = broadcast ? broadcast : &local;
+    if (cache->windowBits != _deflateWindowBits) {
+      cache->deflated = wsDeflate(buffer->data(), buffer->size(), _deflateWindowBits);
+      cache->windowBits = _deflateWindowBits;
+      cache->deflatedFrame = nullptr;
+    }
+    // not compressed when it would not save space
+    if (cache->deflated) {
+      buffer = cache->deflated;
+      compressed = true;
+    }
+  }
+
+  if (broadcast && broadcast->encode && !mask && buffer && !buffer->empty() && _status == WS_CONNECTED) {
+    AsyncWebSocketSharedBuffer &frame = compressed ? broadcast->deflatedFrame : broadcast->frame;
+    if (!frame) {
+      frame = webSocketEncodeFrame(opcode, compressed, buffer->data(), buffer->size());
+    }
+    // sent as a regular message if the frame could not be allocated
+    if (frame) {
+      buffer = frame;
+      encoded = true;
+    }
+  }
+
   asyncsrv::unique_lock_type lock(_queue_lock);
 
-  if (!_client || !buffer || buffer->empty() || _status != WS_CONNECTED) {
+  if (!_client || !buffer || buffer->empty() || _status != WS_CONNECTED || _rejectInProducer()) {
     return false;
   }
 
-  if (_messageQueue.size() >= WS_MAX_QUEUED_MESSAGES) {
-    if (_closeWhenFull) {
-      _status = WS_DISCONNECTED;
+  if (latest) {
+    AsyncWebSocketMessage *msg = _pendingLatest(key);
+    if (msg && buffer->size() > msg->_queuedSize()) {
+      // a larger value goes through the same limits and policy as a new message would,
+      // the queue may change meanwhile (oldest message dropped, lock released to wait for acks)
+      if (!_makeRoom(buffer->size() - msg->_queuedSize(), lock, false)) {
+        return false;
+      }
+      msg = _pendingLatest(key);
+    }
+    if (msg) {
+      async_ws_log_v("[%s][%" PRIu32 "] REPLACE MSG %" PRIu32, _server->url(), _clientId, key);
+      _messageDequeued(msg->_queuedSize());
+      *msg = AsyncWebSocketMessage(buffer, opcode, mask, compressed, encoded);
+      msg->_latest = true;
+      msg->_key = key;
+      _messageQueued(buffer->size());
+      return true;
+    }
+  }
+
+  if (!_makeRoom(buffer->size(), lock)) {
+    return false;
+  }
+
+  if (!_messageQueue.emplace_back(buffer, opcode, mask, compressed, encoded)) {
+    async_ws_log_e("[%s][%" PRIu32 "] Failed to allocate message queue", _server->url(), _clientId);
+    return false;
+  }
+  _messageQueue.back()._latest = latest;
+  _messageQueue.back()._key = key;
+  _messageQueued(buffer->size());
+  async_ws_log_v("[%s][%" PRIu32 "] QUEUE MSG (%u/%u) << %" PRIu8, _server->url(), _clientId, _messageQueue.size(), WS_MAX_QUEUED_MESSAGES, opcode);
+
+  if (_client && _client->canSend() && !_holdForBatch()) {
+    _runQueue();
+  }
+
+  return true;
+}
+
+bool AsyncWebSocketClient::_rejectInProducer() const {
+  if (_inProducer) {
+    async_ws_log_e("[%s][%" PRIu32 "] Cannot send a message from a stream producer", _server->url(), _clientId);
+  }
+  return _inProducer;
+}
+
+bool AsyncWebSocketClient::_makeRoom(size_t len, asyncsrv::unique_lock_type &lock, bool newMessage) {
+#if ASYNCWEBSERVER_USE_MUTEX
+  if (_queueFullPolicy == WS_QUEUE_BLOCK && !_queueHasRoom(len, newMessage) && webSocketCanWait()) {
+    // release the queue so that acks can be processed meanwhile
+    AsyncWebSocket *server = _server;
+    const uint32_t id = _clientId;
+    const uint32_t start = millis();
+    for (;;) {
+      lock.unlock();
+      delay(1);
+      asyncsrv::lock_guard_type clientsLock(server->_ws_clients_lock);
+      // the client may have disconnected meanwhile, its slot freed or reused by another connection
+      if (server->client(id) != this) {
+        return false;
+      }
+      lock.lock();
+      if (!_client || _status != WS_CONNECTED) {
+        return false;
+      }
+      if (_queueHasRoom(len, newMessage) || millis() - start >= WS_QUEUE_BLOCK_TIMEOUT) {
+        break;
+      }
+    }
+  }
+#endif
+
+  if (_queueFullPolicy == WS_QUEUE_DROP_OLDEST) {
+    while (!_queueHasRoom(len, newMessage) && _dropOldestMessage()) {}
+  }
+
+  if (!_queueHasRoom(len, newMessage)) {
+    if (_queueFullPolicy == WS_QUEUE_CLOSE) {
+      _setStatus(WS_DISCONNECTED);
 
       async_ws_log_w("[%s][%" PRIu32 "] Too many messages queued: closing connection", _server->url(), _clientId);
 
@@ -481,14 +1141,32 @@ bool AsyncWebSocketClient::_queueMessage(AsyncWebSocketSharedBuffer buffer, uint
       }
 
     } else {
+      _writableWanted = true;
       async_ws_log_w("[%s][%" PRIu32 "] Too many messages queued: discarding new message", _server->url(), _clientId);
     }
 
     return false;
   }
 
-  _messageQueue.emplace_back(buffer, opcode, mask);
-  async_ws_log_v("[%s][%" PRIu32 "] QUEUE MSG (%u/%u) << %" PRIu8, _server->url(), _clientId, _messageQueue.size(), WS_MAX_QUEUED_MESSAGES, opcode);
+  return true;
+}
+
+bool AsyncWebSocketClient::stream(AwsResponseFiller filler, size_t len, uint8_t opcode) {
+  asyncsrv::unique_lock_type lock(_queue_lock);
+
+  if (!_client || !filler || _status != WS_CONNECTED || _rejectInProducer()) {
+    return false;
+  }
+
+  if (!_makeRoom(0, lock)) {
+    return false;
+  }
+
+  if (!_messageQueue.emplace_back(std::move(filler), len, opcode)) {
+    async_ws_log_e("[%s][%" PRIu32 "] Failed to allocate message queue", _server->url(), _clientId);
+    return false;
+  }
+  async_ws_log_v("[%s][%" PRIu32 "] QUEUE STREAM (%u/%u) << %" PRIu8, _server->url(), _clientId, _messageQueue.size(), WS_MAX_QUEUED_MESSAGES, opcode);
 
   if (_client && _client->canSend()) {
     _runQueue();
@@ -497,6 +1175,42 @@ bool AsyncWebSocketClient::_queueMessage(AsyncWebSocketSharedBuffer buffer, uint
   return true;
 }
 
+bool AsyncWebSocketClient::stream(Stream &source, size_t len, uint8_t opcode) {
+  // a Stream can't tell its end from a temporary lack of data: the length is needed to know when the message is complete
+  if (!len) {
+    async_ws_log_e("[%s][%" PRIu32 "] Stream length required", _server->url(), _clientId);
+    return false;
+  }
+  Stream *s = &source;
+  return stream(
+    [s](uint8_t *buf, size_t maxLen, size_t index) -> size_t {
+      (void)index;
+      const int available = s->available();
+      // a slow source (UART, TCP...) may be empty for a while: wait for its data until the whole message is sent
+      if (available <= 0) {
+        return RESPONSE_TRY_AGAIN;
+      }
+      return s->readBytes(buf, std::min(static_cast<size_t>(available), maxLen));
+    },
+    len, opcode
+  );
+}
+
+bool AsyncWebSocketClient::stream(fs::File file, uint8_t opcode) {
+  if (!file) {
+    return false;
+  }
+  const size_t len = file.size() - file.position();
+  // an empty file is sent as an empty message
+  return stream(
+    [file](uint8_t *buf, size_t maxLen, size_t index) mutable -> size_t {
+      (void)index;
+      return file.read(buf, maxLen);
+    },
+    len, opcode
+  );
+}
+
 void AsyncWebSocketClient::close(uint16_t code, const char *message) {
   if (_status != WS_CONNECTED) {
     return;
@@ -504,7 +1218,7 @@ void AsyncWebSocketClient::close(uint16_t code, const char *message) {
 
   async_ws_log_w("[%s][%" PRIu32 "] CLOSE", _server->url(), _clientId);
 
-  _status = WS_DISCONNECTING;
+  _setStatus(WS_DISCONNECTING);
 
   if (code) {
     uint8_t packetLen = 2;
@@ -515,27 +1229,14 @@ void AsyncWebSocketClient::close(uint16_t code, const char *message) {
       }
       packetLen += mlen;
     }
-    char *buf = (char *)malloc(packetLen);
-    if (buf != NULL) {
-      buf[0] = (uint8_t)(code >> 8);
-      buf[1] = (uint8_t)(code & 0xFF);
-      if (message != NULL) {
-        memcpy(buf + 2, message, packetLen - 2);
-      }
-      _queueControl(WS_DISCONNECT, (uint8_t *)buf, packetLen);
-      free(buf);
-      return;
-    } else {
-      async_ws_log_e("Failed to allocate");
-      // Reads _client, then dereference it without any lock.
-      // A concurrent _onDisconnect could null + delete the client between the check and the use.
-      // Local capture ensures the pointer is read exactly once, eliminating the null-dereference.
-      // (TOCTOU)
-      AsyncClient *c = _client;
-      if (c) {
-        c->abort();
-      }
+    uint8_t buf[125];
+    buf[0] = (uint8_t)(code >> 8);
+    buf[1] = (uint8_t)(code & 0xFF);
+    if (message != NULL) {
+      memcpy(buf + 2, message, packetLen - 2);
     }
+    _queueControl(WS_DISCONNECT, buf, packetLen);
+    return;
   }
   _queueControl(WS_DISCONNECT);
 }
@@ -544,6 +1245,15 @@ bool AsyncWebSocketClient::ping(const uint8_t *data, size_t len) {
   return _status == WS_CONNECTED && _queueControl(WS_PING, data, len);
 }
 
+void AsyncWebSocketClient::_onKeepAlivePong(uint32_t seq) {
+  asyncsrv::lock_guard_type lock(_queue_lock);
+  if (_awaitingReply && _status == WS_CONNECTED && seq == _pingSeq) {
+    _rtt = millis() - _pingSentAt;
+    _awaitingReply = false;
+    async_ws_log_v("[%s][%" PRIu32 "] KEEPALIVE RTT %" PRIu32 " ms", _server->url(), _clientId, _rtt);
+  }
+}
+
 void AsyncWebSocketClient::_onError(int8_t err) {
   async_ws_log_v("[%s][%" PRIu32 "] ERROR %" PRIi8, _server->url(), _clientId, static_cast<int8_t>(err));
 }
@@ -563,7 +1273,7 @@ void AsyncWebSocketClient::_onTimeout(uint32_t time) {
 
 void AsyncWebSocketClient::_onDisconnect() {
   async_ws_log_v("[%s][%" PRIu32 "] DISCONNECT", _server->url(), _clientId);
-  _status = WS_DISCONNECTED;
+  _setStatus(WS_DISCONNECTED);
   {
     // Every queue method (_queueControl, _queueMessage, _runQueue, _onPoll, _onAck) reads _client while holding _queue_lock.
     // For those guarded reads to be meaningful, the write must also be synchronized. This doesn't change _queue_lock's purpose — it still guards queue integrity — but ensures the "is client alive?" checks that protect queue operations see a consistent value.
@@ -575,8 +1285,20 @@ void AsyncWebSocketClient::_onDisconnect() {
 
 void AsyncWebSocketClient::_onData(void *pbuf, size_t plen) {
   _lastMessageTime = millis();
-  uint8_t *data = (uint8_t *)pbuf;
+  _lastActivity = _lastMessageTime;
+  _handleFrames((uint8_t *)pbuf, plen);
+
+  // receive budget: the packet is not acknowledged while the app holds too many bytes, so that the TCP window closes on the sender
+  if (_rxBudget && _client) {
+    asyncsrv::lock_guard_type lock(_queue_lock);
+    if (_rxHeld >= _rxBudget) {
+      _client->ackLater();
+      _rxUnacked += plen;
+    }
+  }
+}
 
+void AsyncWebSocketClient::_handleFrames(uint8_t *data, size_t plen) {
   while (plen > 0) {
     async_ws_log_v(
       "[%s][%" PRIu32 "] DATA plen: %" PRIu32 ", _pstate: %" PRIu8 ", _status: %" PRIu8, _server->url(), _clientId, static_cast<uint32_t>(plen), _pstate,
@@ -606,6 +1328,30 @@ void AsyncWebSocketClient::_onData(void *pbuf, size_t plen) {
         data += 8;
         plen -= 8;
       }
+
+      // RSV1 flags a message compressed with permessage-deflate, it is only allowed on the first frame of a data message
+      const uint8_t rsv = fdata[0] & 0x70;
+      const bool firstDataFrame = _pinfo.opcode == WS_TEXT || _pinfo.opcode == WS_BINARY;
+      if (firstDataFrame) {
+        _inflating = rsv == 0x40 && _deflateWindowBits;
+        _inflateInput.clear();
+      }
+      if (rsv && !(firstDataFrame && _inflating) && !_discardFrames) {
+        async_ws_log_w("[%s][%" PRIu32 "] DATA unexpected RSV bits 0x%02" PRIx8 " on opcode %" PRIu8, _server->url(), _clientId, rsv, _pinfo.opcode);
+        _failConnection(1002);
+      }
+
+      // reassembly: a message exceeding the max size is rejected from its frame header, before its payload is buffered
+      if (firstDataFrame) {
+        _rxMessage.clear();
+      }
+      if (_maxMessageSize && !_inflating && !_discardFrames && _pinfo.opcode < WS_DISCONNECT && _rxMessage.size() + _pinfo.len > _maxMessageSize) {
+        async_ws_log_w(
+          "[%s][%" PRIu32 "] DATA message too large: %" PRIu64 " > %" PRIu32, _server->url(), _clientId, _rxMessage.size() + _pinfo.len,
+          static_cast<uint32_t>(_maxMessageSize)
+        );
+        _failConnection(1009);
+      }
     }
 
     async_ws_log_v(
@@ -654,10 +1400,18 @@ void AsyncWebSocketClient::_onData(void *pbuf, size_t plen) {
 
     const size_t datalen = std::min((size_t)(_pinfo.len - _pinfo.index), plen);
 
-    if (_pinfo.masked) {
-      for (size_t i = 0; i < datalen; i++) {
-        data[i] ^= _pinfo.mask[(_pinfo.index + i) % 4];
+    if (_discardFrames && _pinfo.opcode != WS_DISCONNECT) {
+      _pinfo.index += datalen;
+      if (_pinfo.index == _pinfo.len) {
+        _pstate = STATE_FRAME_START;
       }
+      data += datalen;
+      plen -= datalen;
+      continue;
+    }
+
+    if (_pinfo.masked) {
+      webSocketMask(data, datalen, _pinfo.mask, _pinfo.index);
     }
 
     if (_pinfo.index == 0) {  // first fragment of the frame
@@ -700,12 +1454,12 @@ void AsyncWebSocketClient::_onData(void *pbuf, size_t plen) {
           }
         }
         if (_status == WS_DISCONNECTING) {
-          _status = WS_DISCONNECTED;
+          _setStatus(WS_DISCONNECTED);
           if (_client) {
             _client->close();
           }
         } else {
-          _status = WS_DISCONNECTING;
+          _setStatus(WS_DISCONNECTING);
           if (_client) {
             _client->ackLater();
           }
@@ -719,7 +1473,11 @@ void AsyncWebSocketClient::_onData(void *pbuf, size_t plen) {
 
       } else if (_pinfo.opcode == WS_PONG) {
         async_ws_log_v("[%s][%" PRIu32 "] DATA PONG", _server->url(), _clientId);
-        if (datalen != AWSC_PING_PAYLOAD_LEN || memcmp(AWSC_PING_PAYLOAD, data, AWSC_PING_PAYLOAD_LEN) != 0) {
+        // the pings of the server keepalive carry a sequence number after the payload of the per-client keepalive
+        if (datalen == AWSC_PING_PAYLOAD_LEN + 4 && memcmp(AWSC_PING_PAYLOAD, data, AWSC_PING_PAYLOAD_LEN) == 0) {
+          const uint8_t *seq = data + AWSC_PING_PAYLOAD_LEN;
+          _onKeepAlivePong((uint32_t)seq[0] << 24 | (uint32_t)seq[1] << 16 | (uint32_t)seq[2] << 8 | seq[3]);
+        } else if (datalen != AWSC_PING_PAYLOAD_LEN || memcmp(AWSC_PING_PAYLOAD, data, AWSC_PING_PAYLOAD_LEN) != 0) {
           _server->_handleEvent(this, WS_EVT_PONG, NULL, NULL, 0);
         }
 
@@ -746,7 +1504,7 @@ void AsyncWebSocketClient::_onData(void *pbuf, size_t plen) {
         "[%s][%" PRIu32 "] DATA frame error: len: %u, index: %" PRIu64 ", total: %" PRIu64 "\n", _server->url(), _clientId, datalen, _pinfo.index, _pinfo.len
       );
 
-      _status = WS_DISCONNECTING;
+      _setStatus(WS_DISCONNECTING);
       if (_client) {
         _client->ackLater();
       }
@@ -781,13 +1539,23 @@ void AsyncWebSocketClient::_handleDataEvent(uint8_t *data, size_t len, bool endO
   // - endOfPaquet: is true when datalen == plen. plen is the remaining bytes in the current TCP packet, so if datalen == plen, it means that we are processing the last part of the current TCP packet.
   // In that case, we have to copy since we cannot backup/restore the byte after the data buffer.
   // Otherwise we can backup the byte and restore since we know that the byte after is owned by the current TCP packet (same pointer).
+  if (_inflating) {
+    _handleDeflatedData(data, len);
+  } else if (_maxMessageSize) {
+    _handleMessageData(data, len, endOfPaquet);
+  } else {
+    _deliverTerminated(data, len, endOfPaquet);
+  }
+}
+
+void AsyncWebSocketClient::_deliverTerminated(uint8_t *data, size_t len, bool endOfPaquet) {
   if (_pinfo.message_opcode == WS_TEXT) {
     if (endOfPaquet) {
       std::unique_ptr<uint8_t[]> copy(new (std::nothrow) uint8_t[len + 1]());
       if (copy) {
         memcpy(copy.get(), data, len);
         copy[len] = 0;
-        _server->_handleEvent(this, WS_EVT_DATA, (void *)&_pinfo, copy.get(), len);
+        _deliverData(copy.get(), len);
       } else {
         async_ws_log_e("Failed to allocate");
         if (_client) {
@@ -797,12 +1565,134 @@ void AsyncWebSocketClient::_handleDataEvent(uint8_t *data, size_t len, bool endO
     } else {
       uint8_t backup = data[len];
       data[len] = 0;
-      _server->_handleEvent(this, WS_EVT_DATA, (void *)&_pinfo, data, len);
+      _deliverData(data, len);
       data[len] = backup;
     }
   } else {
-    _server->_handleEvent(this, WS_EVT_DATA, (void *)&_pinfo, data, len);
+    _deliverData(data, len);
+  }
+}
+
+void AsyncWebSocketClient::_deliverData(uint8_t *data, size_t len) {
+  if (_rxBudget) {
+    // accounted before the event so that the handler can release the bytes right away
+    asyncsrv::lock_guard_type lock(_queue_lock);
+    _rxHeld += len;
+  }
+  _server->_handleEvent(this, WS_EVT_DATA, (void *)&_pinfo, data, len);
+}
+
+void AsyncWebSocketClient::setReceiveBudget(size_t budget) {
+  {
+    asyncsrv::lock_guard_type lock(_queue_lock);
+    _rxBudget = budget;
+  }
+  // acknowledge the data held back if the budget was raised or removed
+  release(0);
+}
+
+void AsyncWebSocketClient::release(size_t len) {
+  size_t unacked = 0;
+  AsyncClient *c;
+  {
+    asyncsrv::lock_guard_type lock(_queue_lock);
+    _rxHeld -= std::min(len, _rxHeld);
+    if (_rxUnacked && (!_rxBudget || _rxHeld < _rxBudget)) {
+      unacked = _rxUnacked;
+      _rxUnacked = 0;
+    }
+    // read _client once, under the lock _onDisconnect() clears it with
+    c = _client;
+  }
+  if (unacked && c) {
+    c->ack(unacked);
+  }
+}
+
+size_t AsyncWebSocketClient::heldBytes() const {
+  asyncsrv::lock_guard_type lock(_queue_lock);
+  return _rxHeld;
+}
+
+void AsyncWebSocketClient::_handleDeflatedData(const uint8_t *data, size_t len) {
+  if (_inflateInput.size() + len > WS_DEFLATE_MAX_MESSAGE_SIZE) {
+    async_ws_log_w("[%s][%" PRIu32 "] DATA compressed message too large", _server->url(), _clientId);
+    _failConnection(1009);
+    return;
+  }
+  _inflateInput.insert(_inflateInput.end(), data, data + len);
+
+  // wait for the end of the message
+  if (!_pinfo.final || _pinfo.index + len < _pinfo.len) {
+    return;
+  }
+
+  // the sender removed the trailer of the empty stored block ending the message (RFC 7692 section 7.2.2)
+  static const uint8_t trailer[] = {0x00, 0x00, 0xff, 0xff};
+  _inflateInput.insert(_inflateInput.end(), trailer, trailer + sizeof(trailer));
+
+  std::vector<uint8_t> message;
+  const WsInflateStatus status = wsInflate(_inflateInput.data(), _inflateInput.size(), message, WS_DEFLATE_MAX_MESSAGE_SIZE);
+  std::vector<uint8_t>().swap(_inflateInput);
+  _inflating = false;
+
+  if (status != WS_INFLATE_OK) {
+    async_ws_log_w(
+      "[%s][%" PRIu32 "] DATA %s", _server->url(), _clientId, status == WS_INFLATE_TOO_LARGE ? "inflated message too large" : "invalid compressed data"
+    );
+    _failConnection(status == WS_INFLATE_TOO_LARGE ? 1009 : 1007);
+    return;
+  }
+
+  // the event handler gets the whole message at once, null-terminated like in _handleDataEvent()
+  const size_t size = message.size();
+  message.push_back(0);
+  _pinfo.opcode = _pinfo.message_opcode;
+  _pinfo.num = 0;
+  _pinfo.index = 0;
+  _pinfo.len = size;
+  _deliverData(message.data(), size);
+}
+
+void AsyncWebSocketClient::_handleMessageData(uint8_t *data, size_t len, bool endOfPaquet) {
+  const bool complete = _pinfo.final && _pinfo.index + len == _pinfo.len;
+
+  // the whole message is in this piece of the TCP packet: passed as is, a text message is null-terminated as usual
+  if (complete && _pinfo.index == 0 && _rxMessage.empty()) {
+    _pinfo.opcode = _pinfo.message_opcode;
+    _pinfo.num = 0;
+    _deliverTerminated(data, len, endOfPaquet);
+    return;
+  }
+
+  // room for the rest of the frame and the null terminator, the size was checked against _maxMessageSize when its header was received
+  const size_t needed = _rxMessage.size() + (size_t)(_pinfo.len - _pinfo.index) + 1;
+  if (_rxMessage.capacity() < needed) {
+    _rxMessage.reserve(std::max(needed, std::min(_rxMessage.capacity() * 2, _maxMessageSize)));
+  }
+  _rxMessage.insert(_rxMessage.end(), data, data + len);
+
+  if (!complete) {
+    return;
   }
+
+  _pinfo.opcode = _pinfo.message_opcode;
+  _pinfo.num = 0;
+  _pinfo.index = 0;
+  const size_t size = _rxMessage.size();
+  _pinfo.len = size;
+  // null-terminated like in _handleDataEvent()
+  _rxMessage.push_back(0);
+  _deliverData(_rxMessage.data(), size);
+  std::vector<uint8_t>().swap(_rxMessage);
+}
+
+void AsyncWebSocketClient::_failConnection(uint16_t code) {
+  _discardFrames = true;
+  _inflating = false;
+  std::vector<uint8_t>().swap(_inflateInput);
+  std::vector<uint8_t>().swap(_rxMessage);
+  close(code);
 }
 
 size_t AsyncWebSocketClient::printf(const char *format, ...) {
@@ -931,6 +1821,42 @@ bool AsyncWebSocketClient::binary(AsyncWebSocketSharedBuffer buffer) {
   return _queueMessage(buffer, WS_BINARY);
 }
 
+bool AsyncWebSocketClient::sendLatest(uint32_t key, const uint8_t *message, size_t len, uint8_t opcode) {
+  return sendLatest(key, makeSharedBuffer(message, len), opcode);
+}
+
+bool AsyncWebSocketClient::sendLatest(uint32_t key, const String &message) {
+  return sendLatest(key, makeSharedBuffer((const uint8_t *)message.c_str(), message.length()));
+}
+
+bool AsyncWebSocketClient::subscribe(const String &topic) {
+  asyncsrv::lock_guard_type lock(_server->_ws_clients_lock);
+  if (_status != WS_CONNECTED) {
+    return false;
+  }
+  if (!subscribed(topic)) {
+    _server->_subscribe(this, topic);
+  }
+  return true;
+}
+
+void AsyncWebSocketClient::unsubscribe(const String &topic) {
+  asyncsrv::lock_guard_type lock(_server->_ws_clients_lock);
+  _server->_unsubscribe(this, topic);
+}
+
+void AsyncWebSocketClient::unsubscribeAll() {
+  asyncsrv::lock_guard_type lock(_server->_ws_clients_lock);
+  while (!_topics.empty()) {
+    _server->_unsubscribe(this, _topics.back());
+  }
+}
+
+bool AsyncWebSocketClient::subscribed(const String &topic) const {
+  asyncsrv::lock_guard_type lock(_server->_ws_clients_lock);
+  return std::find(_topics.begin(), _topics.end(), topic) != _topics.end();
+}
+
 bool AsyncWebSocketClient::binary(const uint8_t *message, size_t len) {
   return binary(makeSharedBuffer(message, len));
 }
@@ -995,24 +1921,154 @@ void AsyncWebSocket::_handleEvent(AsyncWebSocketClient *client, AwsEventType typ
   }
 }
 
-AsyncWebSocketClient *AsyncWebSocket::_newClient(AsyncWebServerRequest *request) {
+AsyncWebSocketClient *AsyncWebSocket::_newClient(AsyncWebServerRequest *request, uint8_t deflateWindowBits, size_t handshakeLen) {
   asyncsrv::lock_guard_type lock(_ws_clients_lock);
-  _clients.emplace_back(request, this);
+#if ASYNCWEBSERVER_USE_MUTEX
+  webSocketTcpTask = webSocketCurrentTask();
+#endif
+  if (_clientPool.empty()) {
+    _clients.emplace_back(request, this);
+  } else {
+    _clients.splice(_clients.end(), _clientPool, _clientPool.begin());
+    _rebuildClient(_clients.back(), request);
+  }
+  _clients.back()._deflateWindowBits = deflateWindowBits;
+  _clients.back()._maxMessageSize = _maxMessageSize;
+  _clients.back()._rxBudget = _rxBudget;
+  _clientsById.emplace(_clients.back().id(), std::prev(_clients.end()));
+  _clients.back()._handshakeUnacked = handshakeLen;
+  _scheduleTimer(&_clients.back());
+  {
+    asyncsrv::lock_guard_type countLock(_counters_lock);
+    _connectedClients++;
+  }
   // we've just detached AsyncTCP client from AsyncWebServerRequest
+  const uint32_t id = _clients.back().id();
   _handleEvent(&_clients.back(), WS_EVT_CONNECT, request, NULL, 0);
-  // after user code completed CONNECT event callback we can delete req/response objects
-  delete request;
-  return &_clients.back();
+
+  // the event handler may have disconnected the client
+  const auto iter = _clientsById.find(id);
+  if (iter == _clientsById.end()) {
+    return nullptr;
+  }
+  AsyncWebSocketClient *client = &*iter->second;
+  // push the handshake response if no frame was sent with it
+  asyncsrv::lock_guard_type clientLock(client->_queue_lock);
+  if (client->_client) {
+    client->_client->send();
+  }
+  return client;
 }
 
 void AsyncWebSocket::_handleDisconnect(AsyncWebSocketClient *client) {
   asyncsrv::lock_guard_type lock(_ws_clients_lock);
-  const auto client_id = client->id();
-  const auto iter = std::find_if(std::begin(_clients), std::end(_clients), [client_id](const AsyncWebSocketClient &c) {
-    return c.id() == client_id;
-  });
-  if (iter != std::end(_clients)) {
-    _clients.erase(iter);
+  const auto iter = _clientsById.find(client->id());
+  if (iter != _clientsById.end()) {
+    _eraseClient(iter->second);
+  }
+}
+
+void AsyncWebSocket::_eraseClient(std::list<AsyncWebSocketClient>::iterator client) {
+  // all calls to this method MUST be protected by _ws_clients_lock!
+  client->_setStatus(WS_DISCONNECTED);
+  if (client->_channel) {
+    client->_channel->_removeSubscriber(&*client);
+  }
+  while (!client->_topics.empty()) {
+    _unsubscribe(&*client, client->_topics.back());
+  }
+  _clientsById.erase(client->id());
+  if (_clientPool.size() >= _clientPoolSize) {
+    _clients.erase(client);
+    return;
+  }
+  _rebuildClient(*client, nullptr);
+  _clientPool.splice(_clientPool.end(), _clients, client);
+}
+
+void AsyncWebSocket::_rebuildClient(AsyncWebSocketClient &slot, AsyncWebServerRequest *request) {
+  // the slot is destroyed and constructed again in place, handing the storage of its queues over
+  AsyncRingQueue<AsyncWebSocketControl> controls(std::move(slot._controlQueue));
+  AsyncRingQueue<AsyncWebSocketMessage> messages(std::move(slot._messageQueue));
+  AsyncRingQueue<AsyncWebSocketClient::InFlight> inFlight(std::move(slot._inFlight));
+  slot.~AsyncWebSocketClient();
+  controls.clear();
+  messages.clear();
+  inFlight.clear();
+  if (request) {
+    new (&slot) AsyncWebSocketClient(request, this);
+  } else {
+    new (&slot) AsyncWebSocketClient(this);
+  }
+  slot._controlQueue = std::move(controls);
+  slot._messageQueue = std::move(messages);
+  slot._inFlight = std::move(inFlight);
+}
+
+bool AsyncWebSocket::reserveClients(size_t count) {
+  asyncsrv::lock_guard_type lock(_ws_clients_lock);
+  _clientPoolSize = count;
+  while (_clientPool.size() > count) {
+    _clientPool.pop_back();
+  }
+  for (size_t n = _clients.size() + _clientPool.size(); n < count; n++) {
+    _clientPool.emplace_back(this);
+  }
+  for (auto &slot : _clientPool) {
+    if (!slot._controlQueue.reserve(WS_CONTROL_QUEUE_SIZE) || !slot._messageQueue.reserve(WS_MESSAGE_QUEUE_SIZE)) {
+      async_ws_log_e("[%s] Failed to allocate client slots", _url.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t AsyncWebSocket::freeClientSlots() const {
+  asyncsrv::lock_guard_type lock(_ws_clients_lock);
+  return _clientPool.size();
+}
+
+namespace {
+// "sensors/#" and "#" are wildcards matching all the topics starting with "sensors/" and all the topics
+bool topicPrefix(const String &topic, String &prefix) {
+  const size_t len = topic.length();
+  if (len && topic[len - 1] == '#' && (len == 1 || topic[len - 2] == '/')) {
+    prefix = topic.substring(0, len - 1);
+    return true;
+  }
+  return false;
+}
+}  // namespace
+
+void AsyncWebSocket::_subscribe(AsyncWebSocketClient *client, const String &topic) {
+  // all calls to this method MUST be protected by _ws_clients_lock!
+  String prefix;
+  if (topicPrefix(topic, prefix)) {
+    _prefixSubscribers[prefix].push_back(client);
+  } else {
+    _topicSubscribers[topic].push_back(client);
+  }
+  client->_topics.push_back(topic);
+}
+
+void AsyncWebSocket::_unsubscribe(AsyncWebSocketClient *client, const String &topic) {
+  // all calls to this method MUST be protected by _ws_clients_lock!
+  auto subscription = std::find(client->_topics.begin(), client->_topics.end(), topic);
+  if (subscription == client->_topics.end()) {
+    return;
+  }
+  client->_topics.erase(subscription);
+
+  String prefix;
+  const bool wildcard = topicPrefix(topic, prefix);
+  auto &index = wildcard ? _prefixSubscribers : _topicSubscribers;
+  auto entry = index.find(wildcard ? prefix : topic);
+  if (entry != index.end()) {
+    auto &subscribers = entry->second;
+    subscribers.erase(std::remove(subscribers.begin(), subscribers.end(), client), subscribers.end());
+    if (subscribers.empty()) {
+      index.erase(entry);
+    }
   }
 }
 
@@ -1025,32 +2081,31 @@ bool AsyncWebSocket::availableForWriteAll() {
 
 bool AsyncWebSocket::availableForWrite(uint32_t id) {
   asyncsrv::lock_guard_type lock(_ws_clients_lock);
-  const auto iter = std::find_if(std::begin(_clients), std::end(_clients), [id](const AsyncWebSocketClient &c) {
-    return c.id() == id;
-  });
-  if (iter == std::end(_clients)) {
+  const auto iter = _clientsById.find(id);
+  if (iter == _clientsById.end()) {
     return true;
   }
-  return !iter->queueIsFull();
+  return !iter->second->queueIsFull();
+}
+
+size_t AsyncWebSocket::queuedBytes() const {
+  asyncsrv::lock_guard_type lock(_counters_lock);
+  return _queuedBytes;
 }
 
 size_t AsyncWebSocket::count() const {
-  asyncsrv::lock_guard_type lock(_ws_clients_lock);
-  return std::count_if(std::begin(_clients), std::end(_clients), [](const AsyncWebSocketClient &c) {
-    return c.status() == WS_CONNECTED;
-  });
+  asyncsrv::lock_guard_type lock(_counters_lock);
+  return _connectedClients;
 }
 
 AsyncWebSocketClient *AsyncWebSocket::client(uint32_t id) {
   asyncsrv::lock_guard_type lock(_ws_clients_lock);
-  const auto iter = std::find_if(_clients.begin(), _clients.end(), [id](const AsyncWebSocketClient &c) {
-    return c.id() == id && c.status() == WS_CONNECTED;
-  });
-  if (iter == std::end(_clients)) {
+  const auto iter = _clientsById.find(id);
+  if (iter == _clientsById.end() || iter->second->status() != WS_CONNECTED) {
     return nullptr;
   }
 
-  return &(*iter);
+  return &(*iter->second);
 }
 
 void AsyncWebSocket::close(uint32_t id, uint16_t code, const char *message) {
@@ -1071,6 +2126,7 @@ void AsyncWebSocket::closeAll(uint16_t code, const char *message) {
 
 void AsyncWebSocket::cleanupClients(uint16_t maxClients) {
   asyncsrv::lock_guard_type lock(_ws_clients_lock);
+  _runTimers();
   const size_t c = count();
   if (c > maxClients) {
     async_ws_log_v("[%s] CLEANUP %" PRIu32 " (%u/%" PRIu16 ")", _url.c_str(), _clients.front().id(), c, maxClients);
@@ -1079,12 +2135,140 @@ void AsyncWebSocket::cleanupClients(uint16_t maxClients) {
 
   for (auto i = _clients.begin(); i != _clients.end(); ++i) {
     if (i->shouldBeDeleted()) {
-      _clients.erase(i);
+      _eraseClient(i);
       break;
     }
   }
 }
 
+void AsyncWebSocket::setKeepAlive(uint32_t pingInterval, uint32_t pongTimeout, uint32_t idleTimeout) {
+  asyncsrv::lock_guard_type lock(_ws_clients_lock);
+  _pingInterval = pingInterval;
+  _pongTimeout = pongTimeout;
+  _idleTimeout = idleTimeout;
+  // the entries already in the wheel become stale
+  for (auto &c : _clients) {
+    _scheduleTimer(&c);
+  }
+}
+
+void AsyncWebSocket::_scheduleTimer(AsyncWebSocketClient *client) {
+  // all calls to this method MUST be protected by _ws_clients_lock!
+  bool armed = false;
+  uint32_t due = 0;
+  auto deadline = [&](uint32_t t) {
+    if (!armed || (int32_t)(t - due) < 0) {
+      due = t;
+      armed = true;
+    }
+  };
+  {
+    asyncsrv::lock_guard_type lock(client->_queue_lock);
+    if (client->_awaitingReply) {
+      deadline(client->_pingSentAt + _pongTimeout);
+    } else if (_pingInterval && client->_status == WS_CONNECTED) {
+      deadline(client->_lastActivity + _pingInterval);
+    }
+    if (_idleTimeout && client->_status == WS_CONNECTED) {
+      deadline(client->_lastDataTime + _idleTimeout);
+    }
+    client->_timerArmed = armed;
+    client->_timerDue = due;
+  }
+  if (!armed) {
+    return;
+  }
+
+  if (_timerWheel.empty()) {
+    _timerWheel.resize(WS_TIMER_WHEEL_SLOTS);
+    _timerTick = millis() / WS_TIMER_WHEEL_RESOLUTION;
+  }
+  // a deadline already elapsed is processed on the next tick, the slots up to _timerTick were already processed
+  uint32_t tick = due / WS_TIMER_WHEEL_RESOLUTION;
+  if ((int32_t)(tick - _timerTick) <= 0) {
+    tick = _timerTick + 1;
+  }
+  _timerWheel[tick % WS_TIMER_WHEEL_SLOTS].push_back({client->id(), due});
+}
+
+void AsyncWebSocket::_runTimers() {
+  asyncsrv::lock_guard_type lock(_ws_clients_lock);
+  if (_timerWheel.empty()) {
+    return;
+  }
+  const uint32_t now = millis();
+  const uint32_t nowTick = now / WS_TIMER_WHEEL_RESOLUTION;
+  // after a long pause (or when millis() wraps) each slot is processed once
+  uint32_t ticks = nowTick - _timerTick;
+  if (ticks > WS_TIMER_WHEEL_SLOTS) {
+    _timerTick = nowTick - WS_TIMER_WHEEL_SLOTS;
+    ticks = WS_TIMER_WHEEL_SLOTS;
+  }
+
+  for (; ticks; --ticks) {
+    _timerTick++;
+    _timerFired.swap(_timerWheel[_timerTick % WS_TIMER_WHEEL_SLOTS]);
+    for (const auto &timer : _timerFired) {
+      // an entry due in a later turn of the wheel goes back to its slot
+      if ((int32_t)(timer.due - now) >= WS_TIMER_WHEEL_RESOLUTION) {
+        _timerWheel[_timerTick % WS_TIMER_WHEEL_SLOTS].push_back(timer);
+        continue;
+      }
+      const auto iter = _clientsById.find(timer.clientId);
+      if (iter == _clientsById.end()) {
+        continue;
+      }
+      AsyncWebSocketClient *c = &*iter->second;
+      if (!c->_timerArmed || c->_timerDue != timer.due) {
+        continue;
+      }
+      c->_timerArmed = false;
+      _runTimer(c, now);
+    }
+    _timerFired.clear();
+  }
+}
+
+void AsyncWebSocket::_runTimer(AsyncWebSocketClient *client, uint32_t now) {
+  // all calls to this method MUST be protected by _ws_clients_lock!
+  asyncsrv::unique_lock_type lock(client->_queue_lock);
+  if (!client->_client) {
+    return;
+  }
+
+  if (client->_awaitingReply && now - client->_pingSentAt >= _pongTimeout) {
+    // the peer is gone or stuck: no close handshake, the client is freed by the disconnect
+    async_ws_log_w("[%s][%" PRIu32 "] KEEPALIVE no reply for %" PRIu32 " ms, closing", _url.c_str(), client->_clientId, now - client->_pingSentAt);
+    AsyncClient *c = client->_client;
+    lock.unlock();
+    c->close();
+    return;
+  }
+
+  if (client->_status == WS_CONNECTED && _idleTimeout && now - client->_lastDataTime >= _idleTimeout) {
+    async_ws_log_d("[%s][%" PRIu32 "] KEEPALIVE idle, closing", _url.c_str(), client->_clientId);
+    client->_awaitingReply = true;
+    client->_pingSentAt = now;
+    client->_pingSeq++;
+    client->close(1001);
+  } else if (client->_status == WS_CONNECTED && _pingInterval && !client->_awaitingReply && now - client->_lastActivity >= _pingInterval) {
+    uint8_t payload[AWSC_PING_PAYLOAD_LEN + 4];
+    const uint32_t seq = ++client->_pingSeq;
+    memcpy(payload, AWSC_PING_PAYLOAD, AWSC_PING_PAYLOAD_LEN);
+    payload[AWSC_PING_PAYLOAD_LEN] = seq >> 24;
+    payload[AWSC_PING_PAYLOAD_LEN + 1] = seq >> 16;
+    payload[AWSC_PING_PAYLOAD_LEN + 2] = seq >> 8;
+    payload[AWSC_PING_PAYLOAD_LEN + 3] = seq;
+    if (client->ping(payload, sizeof(payload))) {
+      client->_awaitingReply = true;
+      client->_pingSentAt = now;
+    }
+  }
+  lock.unlock();
+
+  _scheduleTimer(client);
+}
+
 bool AsyncWebSocket::ping(uint32_t id, const uint8_t *data, size_t len) {
   asyncsrv::lock_guard_type lock(_ws_clients_lock);
   AsyncWebSocketClient *c = client(id);
@@ -1107,6 +2291,7 @@ AsyncWebSocket::SendStatus AsyncWebSocket::pingAll(const uint8_t *data, size_t l
 
 bool AsyncWebSocket::text(uint32_t id, const uint8_t *message, size_t len) {
   asyncsrv::lock_guard_type lock(_ws_clients_lock);
+  WebSocketNoWaitScope noWait;
   AsyncWebSocketClient *c = client(id);
   return c && c->text(makeSharedBuffer(message, len));
 }
@@ -1154,6 +2339,7 @@ bool AsyncWebSocket::text(uint32_t id, AsyncWebSocketMessageBuffer *buffer) {
 }
 bool AsyncWebSocket::text(uint32_t id, AsyncWebSocketSharedBuffer buffer) {
   asyncsrv::lock_guard_type lock(_ws_clients_lock);
+  WebSocketNoWaitScope noWait;
   AsyncWebSocketClient *c = client(id);
   return c && c->text(buffer);
 }
@@ -1204,10 +2390,14 @@ AsyncWebSocket::SendStatus AsyncWebSocket::textAll(AsyncWebSocketMessageBuffer *
 
 AsyncWebSocket::SendStatus AsyncWebSocket::textAll(AsyncWebSocketSharedBuffer buffer) {
   asyncsrv::lock_guard_type lock(_ws_clients_lock);
+  WebSocketNoWaitScope noWait;
   size_t hit = 0;
   size_t miss = 0;
+  // compressed and encoded once for all the clients
+  AsyncWebSocketBroadcastBuffer broadcast;
+  broadcast.encode = count() > 1;
   for (auto &c : _clients) {
-    if (c.status() == WS_CONNECTED && c.text(buffer)) {
+    if (c.status() == WS_CONNECTED && c._queueMessage(buffer, WS_TEXT, false, &broadcast)) {
       hit++;
     } else {
       miss++;
@@ -1218,6 +2408,7 @@ AsyncWebSocket::SendStatus AsyncWebSocket::textAll(AsyncWebSocketSharedBuffer bu
 
 bool AsyncWebSocket::binary(uint32_t id, const uint8_t *message, size_t len) {
   asyncsrv::lock_guard_type lock(_ws_clients_lock);
+  WebSocketNoWaitScope noWait;
   AsyncWebSocketClient *c = client(id);
   return c && c->binary(makeSharedBuffer(message, len));
 }
@@ -1255,6 +2446,7 @@ bool AsyncWebSocket::binary(uint32_t id, AsyncWebSocketMessageBuffer *buffer) {
 }
 bool AsyncWebSocket::binary(uint32_t id, AsyncWebSocketSharedBuffer buffer) {
   asyncsrv::lock_guard_type lock(_ws_clients_lock);
+  WebSocketNoWaitScope noWait;
   AsyncWebSocketClient *c = client(id);
   return c && c->binary(buffer);
 }
@@ -1296,10 +2488,78 @@ AsyncWebSocket::SendStatus AsyncWebSocket::binaryAll(AsyncWebSocketMessageBuffer
 }
 AsyncWebSocket::SendStatus AsyncWebSocket::binaryAll(AsyncWebSocketSharedBuffer buffer) {
   asyncsrv::lock_guard_type lock(_ws_clients_lock);
+  WebSocketNoWaitScope noWait;
+  size_t hit = 0;
+  size_t miss = 0;
+  // compressed and encoded once for all the clients
+  AsyncWebSocketBroadcastBuffer broadcast;
+  broadcast.encode = count() > 1;
+  for (auto &c : _clients) {
+    if (c.status() == WS_CONNECTED && c._queueMessage(buffer, WS_BINARY, false, &broadcast)) {
+      hit++;
+    } else {
+      miss++;
+    }
+  }
+  return hit == 0 ? DISCARDED : (miss == 0 ? ENQUEUED : PARTIALLY_ENQUEUED);
+}
+
+AsyncWebSocket::SendStatus AsyncWebSocket::sendLatestAll(uint32_t key, AsyncWebSocketSharedBuffer buffer, uint8_t opcode) {
+  asyncsrv::lock_guard_type lock(_ws_clients_lock);
+  WebSocketNoWaitScope noWait;
   size_t hit = 0;
   size_t miss = 0;
+  // compressed and encoded once for all the clients
+  AsyncWebSocketBroadcastBuffer broadcast;
+  broadcast.encode = count() > 1;
   for (auto &c : _clients) {
-    if (c.status() == WS_CONNECTED && c.binary(buffer)) {
+    if (c.status() == WS_CONNECTED && c._queueMessage(buffer, opcode, false, &broadcast, true, key)) {
+      hit++;
+    } else {
+      miss++;
+    }
+  }
+  return hit == 0 ? DISCARDED : (miss == 0 ? ENQUEUED : PARTIALLY_ENQUEUED);
+}
+AsyncWebSocket::SendStatus AsyncWebSocket::sendLatestAll(uint32_t key, const uint8_t *message, size_t len, uint8_t opcode) {
+  return sendLatestAll(key, makeSharedBuffer(message, len), opcode);
+}
+AsyncWebSocket::SendStatus AsyncWebSocket::sendLatestAll(uint32_t key, const String &message) {
+  return sendLatestAll(key, makeSharedBuffer((const uint8_t *)message.c_str(), message.length()));
+}
+
+AsyncWebSocket::SendStatus AsyncWebSocket::publish(const String &topic, AsyncWebSocketSharedBuffer buffer, uint8_t opcode) {
+  asyncsrv::lock_guard_type lock(_ws_clients_lock);
+  WebSocketNoWaitScope noWait;
+  std::vector<AsyncWebSocketClient *> recipients;
+  auto collect = [&recipients](const std::map<String, std::vector<AsyncWebSocketClient *>> &index, const String &key) {
+    const auto entry = index.find(key);
+    if (entry != index.end()) {
+      recipients.insert(recipients.end(), entry->second.begin(), entry->second.end());
+    }
+  };
+
+  collect(_topicSubscribers, topic);
+  if (!_prefixSubscribers.empty()) {
+    // one lookup per level of the topic: "#", "a/#", "a/b/#" and "a/b/c/#" for "a/b/c"
+    collect(_prefixSubscribers, emptyString);
+    for (int i = topic.indexOf('/'); i >= 0; i = topic.indexOf('/', i + 1)) {
+      collect(_prefixSubscribers, topic.substring(0, i + 1));
+    }
+    collect(_prefixSubscribers, topic + '/');
+  }
+
+  // a client matching several patterns gets the message once
+  std::sort(recipients.begin(), recipients.end());
+  recipients.erase(std::unique(recipients.begin(), recipients.end()), recipients.end());
+
+  size_t hit = 0;
+  size_t miss = 0;
+  // compressed and encoded once for all the subscribers
+  AsyncWebSocketBroadcastBuffer broadcast;
+  broadcast.encode = recipients.size() > 1;
+  for (AsyncWebSocketClient *c : recipients) {
+    if (c->status() == WS_CONNECTED && c->_queueMessage(buffer, opcode, false, &broadcast)) {
       hit++;
     } else {
       miss++;
@@ -1307,6 +2567,12 @@ AsyncWebSocket::SendStatus AsyncWebSocket::binaryAll(AsyncWebSocketSharedBuffer
   }
   return hit == 0 ? DISCARDED : (miss == 0 ? ENQUEUED : PARTIALLY_ENQUEUED);
 }
+AsyncWebSocket::SendStatus AsyncWebSocket::publish(const String &topic, const uint8_t *message, size_t len, uint8_t opcode) {
+  return publish(topic, makeSharedBuffer(message, len), opcode);
+}
+AsyncWebSocket::SendStatus AsyncWebSocket::publish(const String &topic, const String &message) {
+  return publish(topic, makeSharedBuffer((const uint8_t *)message.c_str(), message.length()));
+}
 
 size_t AsyncWebSocket::printf(uint32_t id, const char *format, ...) {
   AsyncWebSocketClient *c = client(id);
@@ -1392,6 +2658,8 @@ const char __WS_STR_VERSION[] PROGMEM = {"Sec-WebSocket-Version"};
 const char __WS_STR_KEY[] PROGMEM = {"Sec-WebSocket-Key"};
 const char __WS_STR_PROTOCOL[] PROGMEM = {"Sec-WebSocket-Protocol"};
 const char __WS_STR_ACCEPT[] PROGMEM = {"Sec-WebSocket-Accept"};
+const char __WS_STR_EXTENSIONS[] PROGMEM = {"Sec-WebSocket-Extensions"};
+const char __WS_STR_PERMESSAGE_DEFLATE[] PROGMEM = {"permessage-deflate"};
 const char __WS_STR_UUID[] PROGMEM = {"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"};
 
 #define WS_STR_UUID_LEN 36
@@ -1405,6 +2673,87 @@ const char __WS_STR_UUID[] PROGMEM = {"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"};
 #define WS_STR_PROTOCOL   FPSTR(__WS_STR_PROTOCOL)
 #define WS_STR_ACCEPT     FPSTR(__WS_STR_ACCEPT)
 #define WS_STR_UUID       FPSTR(__WS_STR_UUID)
+#define WS_STR_EXTENSIONS FPSTR(__WS_STR_EXTENSIONS)
+#define WS_STR_PMCE       FPSTR(__WS_STR_PERMESSAGE_DEFLATE)
+
+namespace {
+// Look for an acceptable permessage-deflate offer (RFC 7692 section 7.1) in the value of a Sec-WebSocket-Extensions request header.
+// Compression contexts are never kept between messages, so the response always includes server_no_context_takeover and client_no_context_takeover.
+// Returns the window used to compress the messages sent to the client and fills @p response, or 0 if there is no acceptable offer.
+uint8_t negotiateDeflate(const String &offers, uint8_t windowBits, String &response) {
+  int start = 0;
+  while (start < (int)offers.length()) {
+    int end = offers.indexOf(',', start);
+    if (end < 0) {
+      end = offers.length();
+    }
+    const String offer = offers.substring(start, end);
+    start = end + 1;
+
+    int param = offer.indexOf(';');
+    String name = offer.substring(0, param < 0 ? offer.length() : param);
+    name.trim();
+    if (!name.equals(WS_STR_PMCE)) {
+      continue;
+    }
+
+    bool accepted = true;
+    bool serverNoContextTakeover = false;
+    bool clientNoContextTakeover = false;
+    uint8_t serverMaxWindowBits = 0;
+    bool clientMaxWindowBits = false;
+    while (param >= 0 && accepted) {
+      const int next = offer.indexOf(';', param + 1);
+      String key = offer.substring(param + 1, next < 0 ? offer.length() : next);
+      param = next;
+
+      String value;
+      const int eq = key.indexOf('=');
+      if (eq >= 0) {
+        value = key.substring(eq + 1);
+        key.remove(eq);
+        value.trim();
+        if (value.length() >= 2 && value[0] == '"' && value[value.length() - 1] == '"') {
+          value = value.substring(1, value.length() - 1);
+        }
+      }
+      key.trim();
+      const long bits = value.toInt();
+
+      // each parameter can only be given once, window bits must be between 8 and 15
+      if (key.equals(F("server_no_context_takeover"))) {
+        accepted = !serverNoContextTakeover && eq < 0;
+        serverNoContextTakeover = true;
+      } else if (key.equals(F("client_no_context_takeover"))) {
+        accepted = !clientNoContextTakeover && eq < 0;
+        clientNoContextTakeover = true;
+      } else if (key.equals(F("server_max_window_bits"))) {
+        accepted = !serverMaxWindowBits && bits >= 8 && bits <= 15;
+        serverMaxWindowBits = bits;
+      } else if (key.equals(F("client_max_window_bits"))) {
+        // the client window does not matter: messages are decompressed from a whole buffer and without context takeover
+        accepted = !clientMaxWindowBits && (eq < 0 || (bits >= 8 && bits <= 15));
+        clientMaxWindowBits = true;
+      } else {
+        accepted = false;
+      }
+    }
+    if (!accepted) {
+      continue;
+    }
+
+    response = WS_STR_PMCE;
+    response.concat(F("; server_no_context_takeover; client_no_context_takeover"));
+    if (serverMaxWindowBits) {
+      windowBits = std::min(windowBits, serverMaxWindowBits);
+      response.concat(F("; server_max_window_bits="));
+      response.concat(windowBits);
+    }
+    return windowBits;
+  }
+  return 0;
+}
+}  // namespace
 
 bool AsyncWebSocket::canHandle(AsyncWebServerRequest *request) const {
   return _enabled && request->isWebSocketUpgrade() && request->url().equals(_url);
@@ -1428,13 +2777,27 @@ void AsyncWebSocket::handleRequest(AsyncWebServerRequest *request) {
     request->send(response);
     return;
   }
+  // only a valid and authorized upgrade can make room, an upgrade rejected later must not evict a client
+  if (!_makeRoomForClient()) {
+    async_ws_log_w("[%s] Too many clients: rejecting upgrade", _url.c_str());
+    request->send(503);
+    return;
+  }
   const AsyncWebHeader *key = request->getHeader(WS_STR_KEY);
-  AsyncWebServerResponse *response = new AsyncWebSocketResponse(key->value(), this);
+  String extensions;
+  uint8_t deflateWindowBits = 0;
+  if (_deflateWindowBits && request->hasHeader(WS_STR_EXTENSIONS)) {
+    deflateWindowBits = negotiateDeflate(request->getHeader(WS_STR_EXTENSIONS)->value(), _deflateWindowBits, extensions);
+  }
+  AsyncWebServerResponse *response = new AsyncWebSocketResponse(key->value(), this, deflateWindowBits);
   if (response == NULL) {
     async_ws_log_e("Failed to allocate");
     request->abort();
     return;
   }
+  if (deflateWindowBits) {
+    response->addHeader(WS_STR_EXTENSIONS, extensions);
+  }
   if (request->hasHeader(WS_STR_PROTOCOL)) {
     const AsyncWebHeader *protocol = request->getHeader(WS_STR_PROTOCOL);
     // ToDo: check protocol
@@ -1443,6 +2806,43 @@ void AsyncWebSocket::handleRequest(AsyncWebServerRequest *request) {
   request->send(response);
 }
 
+void AsyncWebSocket::setMaxClients(size_t max, AwsClientLimitPolicy policy) {
+  asyncsrv::lock_guard_type lock(_ws_clients_lock);
+  _maxClients = max;
+  _clientLimitPolicy = policy;
+  if (max) {
+    _clientPoolSize = max;
+    while (_clientPool.size() > max) {
+      _clientPool.pop_back();
+    }
+  }
+}
+
+bool AsyncWebSocket::_makeRoomForClient() {
+  asyncsrv::lock_guard_type lock(_ws_clients_lock);
+  if (!_maxClients || _clients.size() + _pendingClients < _maxClients) {
+    return true;
+  }
+  if (_clientLimitPolicy != WS_LIMIT_CLOSE_OLDEST || _clients.empty()) {
+    return false;
+  }
+  // the oldest client is disconnected right away, its slot is freed by the disconnect (synchronously with AsyncTCP)
+  auto oldest = _clients.begin();
+  async_ws_log_w("[%s][%" PRIu32 "] Too many clients: closing the oldest one", _url.c_str(), oldest->id());
+  AsyncClient *c = oldest->_client;
+  if (c) {
+    c->close();
+  } else {
+    _eraseClient(oldest);
+  }
+  return _clients.size() + _pendingClients < _maxClients;
+}
+
+void AsyncWebSocket::enablePerMessageDeflate(bool enable, size_t threshold, uint8_t windowBits) {
+  _deflateWindowBits = enable ? std::min(std::max(windowBits, (uint8_t)8), (uint8_t)15) : 0;
+  _deflateThreshold = threshold;
+}
+
 AsyncWebSocketMessageBuffer *AsyncWebSocket::makeBuffer(size_t size) {
   return new AsyncWebSocketMessageBuffer(size);
 }
@@ -1451,12 +2851,147 @@ AsyncWebSocketMessageBuffer *AsyncWebSocket::makeBuffer(const uint8_t *data, siz
   return new AsyncWebSocketMessageBuffer(data, size);
 }
 
+/*
+ * Broadcast channel - frames encoded once in a ring read by the subscribed clients
+ */
+
+AsyncWebSocketChannel::AsyncWebSocketChannel(AsyncWebSocket &server, size_t capacity, AwsChannelLagPolicy lagPolicy)
+  : _server(&server), _ring(new (std::nothrow) uint8_t[capacity]), _capacity(capacity), _lagPolicy(lagPolicy) {
+  if (!_ring) {
+    async_ws_log_e("Failed to allocate");
+    _capacity = 0;
+  }
+}
+
+AsyncWebSocketChannel::~AsyncWebSocketChannel() {
+  asyncsrv::lock_guard_type lock(_server->_ws_clients_lock);
+  while (!_subscribers.empty()) {
+    _removeSubscriber(_subscribers.back());
+  }
+}
+
+bool AsyncWebSocketChannel::subscribe(AsyncWebSocketClient *client) {
+  if (!_ring || !client || client->_server != _server) {
+    return false;
+  }
+  asyncsrv::lock_guard_type lock(_server->_ws_clients_lock);
+  asyncsrv::lock_guard_type clientLock(client->_queue_lock);
+  if (client->_channel || client->_status != WS_CONNECTED) {
+    return client->_channel == this;
+  }
+  asyncsrv::lock_guard_type channelLock(_lock);
+  client->_channel = this;
+  client->_channelCursor = _end;
+  client->_channelFrameLeft = 0;
+  _subscribers.push_back(client);
+  return true;
+}
+
+void AsyncWebSocketChannel::unsubscribe(AsyncWebSocketClient *client) {
+  asyncsrv::lock_guard_type lock(_server->_ws_clients_lock);
+  if (client && client->_channel == this) {
+    _removeSubscriber(client);
+  }
+}
+
+void AsyncWebSocketChannel::_removeSubscriber(AsyncWebSocketClient *client) {
+  // all calls to this method MUST be protected by the server's _ws_clients_lock!
+  _subscribers.erase(std::remove(_subscribers.begin(), _subscribers.end(), client), _subscribers.end());
+  asyncsrv::lock_guard_type clientLock(client->_queue_lock);
+  asyncsrv::lock_guard_type channelLock(_lock);
+  client->_detachChannel();
+}
+
+size_t AsyncWebSocketChannel::count() const {
+  asyncsrv::lock_guard_type lock(_server->_ws_clients_lock);
+  return _subscribers.size();
+}
+
+bool AsyncWebSocketChannel::publish(const uint8_t *data, size_t len, uint8_t opcode) {
+  uint8_t header[10];
+  const size_t headLen = webSocketFrameHeader(header, 0x80 | (opcode & 0x0F), len);
+  if (headLen + len > _capacity) {
+    async_ws_log_w("[%s] CHANNEL frame of %" PRIu32 " bytes does not fit in the ring", _server->url(), static_cast<uint32_t>(headLen + len));
+    return false;
+  }
+
+  asyncsrv::lock_guard_type lock(_server->_ws_clients_lock);
+  {
+    asyncsrv::lock_guard_type channelLock(_lock);
+    // the oldest frames are dropped to make room, the clients which did not send them yet are lagging
+    while (_end + headLen + len - _start > _capacity) {
+      _start += _frameSize(_start);
+    }
+    _copyIn(_end, header, headLen);
+    _copyIn(_end + headLen, data, len);
+    _end += headLen + len;
+  }
+
+  // backwards: a client closed while flushing is removed from _subscribers
+  for (size_t i = _subscribers.size(); i-- > 0;) {
+    if (i < _subscribers.size()) {
+      _subscribers[i]->_flushChannel();
+    }
+  }
+  return true;
+}
+
+size_t AsyncWebSocketChannel::_frameSize(uint64_t pos) const {
+  uint8_t header[10];
+  _copyOut(pos, header, 2);
+  const size_t len = header[1] & 0x7F;
+  if (len < 126) {
+    return 2 + len;
+  }
+  if (len == 126) {
+    _copyOut(pos, header, 4);
+    return 4 + ((size_t)header[2] << 8 | header[3]);
+  }
+  _copyOut(pos, header, 10);
+  uint64_t len64 = 0;
+  for (size_t i = 2; i < 10; i++) {
+    len64 = len64 << 8 | header[i];
+  }
+  return 10 + (size_t)len64;
+}
+
+void AsyncWebSocketChannel::_copyIn(uint64_t pos, const uint8_t *data, size_t len) {
+  const size_t offset = pos % _capacity;
+  const size_t first = std::min(len, _capacity - offset);
+  memcpy(_ring.get() + offset, data, first);
+  memcpy(_ring.get(), data + first, len - first);
+}
+
+void AsyncWebSocketChannel::_copyOut(uint64_t pos, uint8_t *data, size_t len) const {
+  const size_t offset = pos % _capacity;
+  const size_t first = std::min(len, _capacity - offset);
+  memcpy(data, _ring.get() + offset, first);
+  memcpy(data + first, _ring.get(), len - first);
+}
+
+size_t AsyncWebSocketChannel::_addTo(AsyncClient *client, uint64_t pos, size_t len) const {
+  // copied: the ring is overwritten while the bytes may still wait for their TCP ack
+  const size_t offset = pos % _capacity;
+  const size_t first = std::min(len, _capacity - offset);
+  size_t added = client->add((const char *)_ring.get() + offset, first, ASYNC_WRITE_FLAG_COPY);
+  if (added == first && len > first) {
+    added += client->add((const char *)_ring.get(), len - first, ASYNC_WRITE_FLAG_COPY);
+  }
+  return added;
+}
+
 /*
  * Response to Web Socket request - sends the authorization and detaches the TCP Client from the web server
  * Authentication code from https://github.com/Links2004/arduinoWebSockets/blob/master/src/WebSockets.cpp#L480
  */
 
-AsyncWebSocketResponse::AsyncWebSocketResponse(const String &key, AsyncWebSocket *server) : _server(server) {
+AsyncWebSocketResponse::AsyncWebSocketResponse(const String &key, AsyncWebSocket *server, uint8_t deflateWindowBits)
+  : _server(server), _deflateWindowBits(deflateWindowBits) {
+  {
+    // counted against the max num of clients until it is destroyed, once the client is created or the handshake failed
+    asyncsrv::lock_guard_type lock(_server->_ws_clients_lock);
+    _server->_pendingClients++;
+  }
   _code = 101;
   _sendContentLength = false;
 
@@ -1497,31 +3032,27 @@ AsyncWebSocketResponse::AsyncWebSocketResponse(const String &key, AsyncWebSocket
   addHeader(WS_STR_ACCEPT, buffer);
 }
 
+AsyncWebSocketResponse::~AsyncWebSocketResponse() {
+  asyncsrv::lock_guard_type lock(_server->_ws_clients_lock);
+  _server->_pendingClients--;
+}
+
 void AsyncWebSocketResponse::_respond(AsyncWebServerRequest *request) {
   if (_state == RESPONSE_FAILED) {
     request->client()->close();
     return;
   }
-  // unbind client's onAck callback from AsyncWebServerRequest's, we will destroy it on next callback and steal the client,
-  // can't do it now 'cause now we are in AsyncWebServerRequest::_onAck 's stack actually
-  // here we are loosing time on one RTT delay, but with current design we can't get rid of Req/Resp objects other way
-  _request = request;
-  request->client()->onAck(
-    [](void *r, AsyncClient *c, size_t len, uint32_t time) {
-      if (len) {
-        static_cast<AsyncWebSocketResponse *>(r)->_switchClient();
-      }
-    },
-    this
-  );
+  // the connection is switched to the WebSocket client right away, without waiting for the ack of the head:
+  // the head is only added to the TCP buffer and the client pushes it with the frames queued on WS_EVT_CONNECT.
+  // The request (and *this) are deleted once the current AsyncTCP callback returns, see AsyncWebServerRequest::clientRelease()
   String out;
   _assembleHead(out, request->version());
-  request->client()->write(out.c_str(), _headLength);
-  _state = RESPONSE_WAIT_ACK;
-}
-
-void AsyncWebSocketResponse::_switchClient() {
-  // detach client from request
-  _server->_newClient(_request);
-  // _newClient() would also destruct _request and *this
+  if (request->client()->add(out.c_str(), _headLength) < _headLength) {
+    async_ws_log_e("Failed to add the handshake response");
+    _state = RESPONSE_FAILED;
+    request->client()->close();
+    return;
+  }
+  _state = RESPONSE_END;
+  _server->_newClient(request, _deflateWindowBits, _headLength);
 }
@@ -30,11 +30,15 @@
 
 #include <ESPAsyncWebServer.h>
 #include <AsyncWebServerLogging.h>
+#include "AsyncRingQueue.h"
+#include "AsyncWebSocketDeflate.h"
 
 #include <cstdio>
-#include <deque>
 #include <list>
+#include <map>
 #include <memory>
+#include <unordered_map>
+#include <vector>
 
 #if defined(ESP8266) || defined(TARGET_RP2040) || defined(TARGET_RP2350) || defined(PICO_RP2040) || defined(PICO_RP2350)
 #include <Hash.h>
@@ -51,11 +55,95 @@
 #endif
 #endif
 
+// max num of clients of an AsyncWebSocket, including the handshakes in progress, see AsyncWebSocket::setMaxClients(), 0 for no limit
+#ifndef WS_MAX_CLIENTS
+#define WS_MAX_CLIENTS 0
+#endif
+
+// num of client slots an AsyncWebSocket keeps after a disconnect to reuse them, see AsyncWebSocket::reserveClients()
+#ifndef WS_CLIENT_POOL_SIZE
+#define WS_CLIENT_POOL_SIZE DEFAULT_MAX_WS_CLIENTS
+#endif
+
+// num of control frames the queue of a client is allocated for, it grows if more are queued
+#ifndef WS_CONTROL_QUEUE_SIZE
+#define WS_CONTROL_QUEUE_SIZE 4
+#endif
+
+// num of messages the queue of a client is allocated for, it grows if more are queued (up to WS_MAX_QUEUED_MESSAGES)
+#ifndef WS_MESSAGE_QUEUE_SIZE
+#define WS_MESSAGE_QUEUE_SIZE 8
+#endif
+
+// default max size of a message reassembled from its frames, see AsyncWebSocket::enableMessageReassembly()
+#ifndef WS_MAX_MESSAGE_SIZE
+#ifdef ESP8266
+#define WS_MAX_MESSAGE_SIZE 4096
+#else
+#define WS_MAX_MESSAGE_SIZE 16384
+#endif
+#endif
+
+// default receive budget of the clients, see AsyncWebSocket::setReceiveBudget(), 0 for no limit
+#ifndef WS_RECEIVE_BUDGET
+#define WS_RECEIVE_BUDGET 0
+#endif
+
+// max num of bytes queued for sending to a client, 0 for no limit (WS_MAX_QUEUED_MESSAGES still applies)
+#ifndef WS_MAX_QUEUED_BYTES
+#define WS_MAX_QUEUED_BYTES 0
+#endif
+
+// max num of bytes queued for sending to all the clients of an AsyncWebSocket, 0 for no limit
+#ifndef WS_MAX_QUEUED_BYTES_TOTAL
+#define WS_MAX_QUEUED_BYTES_TOTAL 0
+#endif
+
+// max time in ms a send waits for room in the queue with the WS_QUEUE_BLOCK policy
+#ifndef WS_QUEUE_BLOCK_TIMEOUT
+#define WS_QUEUE_BLOCK_TIMEOUT 100
+#endif
+
+// max time in ms a message is held to be sent with the next ones while previous data is not acked, see AsyncWebSocket::setFlushDelay()
+#ifndef WS_FLUSH_DELAY
+#define WS_FLUSH_DELAY 0
+#endif
+
+// keepalive of the connected clients, see AsyncWebSocket::setKeepAlive(): time in ms without receiving anything before a client is pinged,
+// max time in ms to wait for its pong (or for the reply to a close frame) and time in ms without any message before a client is closed, 0 to disable
+#ifndef WS_PING_INTERVAL
+#define WS_PING_INTERVAL 0
+#endif
+#ifndef WS_PONG_TIMEOUT
+#define WS_PONG_TIMEOUT 5000
+#endif
+#ifndef WS_IDLE_TIMEOUT
+#define WS_IDLE_TIMEOUT 0
+#endif
+
+// the keepalive deadlines are kept in a timer wheel of WS_TIMER_WHEEL_SLOTS slots of WS_TIMER_WHEEL_RESOLUTION ms each
+#ifndef WS_TIMER_WHEEL_SLOTS
+#define WS_TIMER_WHEEL_SLOTS 32
+#endif
+#ifndef WS_TIMER_WHEEL_RESOLUTION
+#define WS_TIMER_WHEEL_RESOLUTION 250
+#endif
+
+// max size of the chunks a streamed message is produced in, see AsyncWebSocketClient::stream()
+#ifndef WS_STREAM_CHUNK_SIZE
+#ifdef ESP8266
+#define WS_STREAM_CHUNK_SIZE 1024
+#else
+#define WS_STREAM_CHUNK_SIZE 2048
+#endif
+#endif
+
 using AsyncWebSocketSharedBuffer = std::shared_ptr<std::vector<uint8_t>>;
 
 class AsyncWebSocket;
 class AsyncWebSocketResponse;
 class AsyncWebSocketClient;
+class AsyncWebSocketChannel;
 
 /*
  * Control Frame
@@ -64,38 +152,17 @@ class AsyncWebSocketClient;
 class AsyncWebSocketControl {
 private:
   uint8_t _opcode;
-  uint8_t *_data;
-  size_t _len;
+  uint8_t _len;
   bool _mask;
   bool _finished;
+  // control frame payloads are at most 125 bytes: kept inline so queuing a control frame does not allocate
+  uint8_t _data[125];
 
 public:
   AsyncWebSocketControl(uint8_t opcode, const uint8_t *data = NULL, size_t len = 0, bool mask = false)
-    : _opcode(opcode), _len(len), _mask(len && mask), _finished(false) {
-    if (data == NULL) {
-      _len = 0;
-    }
+    : _opcode(opcode), _len(data == NULL ? 0 : (len > 125 ? 125 : len)), _mask(_len && mask), _finished(false) {
     if (_len) {
-      if (_len > 125) {
-        _len = 125;
-      }
-
-      _data = (uint8_t *)malloc(_len);
-
-      if (_data == NULL) {
-        async_ws_log_e("Failed to allocate");
-        _len = 0;
-      } else {
-        memcpy(_data, data, len);
-      }
-    } else {
-      _data = NULL;
-    }
-  }
-
-  ~AsyncWebSocketControl() {
-    if (_data != NULL) {
-      free(_data);
+      memcpy(_data, data, _len);
     }
   }
 
@@ -159,8 +226,38 @@ typedef enum {
   WS_EVT_PING,
   WS_EVT_PONG,
   WS_EVT_ERROR,
-  WS_EVT_DATA
+  WS_EVT_DATA,
+  // a message was discarded because the send queue was full, and the queue went back below the low watermark
+  WS_EVT_WRITABLE
 } AwsEventType;
+// what to do with a message that does not fit in the send queue of a client
+typedef enum {
+  // discard the new message
+  WS_QUEUE_DROP_NEWEST,
+  // discard the oldest messages not sent yet to make room, or the new one if that is not enough
+  WS_QUEUE_DROP_OLDEST,
+  // close the connection
+  WS_QUEUE_CLOSE,
+  // wait up to WS_QUEUE_BLOCK_TIMEOUT ms for room, then discard the new message.
+  // Only a send made with AsyncWebSocketClient methods from another task than AsyncTCP's waits, otherwise this is WS_QUEUE_DROP_NEWEST
+  WS_QUEUE_BLOCK
+} AwsQueueFullPolicy;
+
+// what happens to a client of an AsyncWebSocketChannel when the frames it has not sent yet are overwritten by newer ones
+typedef enum {
+  // the client skips to the oldest frame still in the channel, losing the frames in between
+  WS_CHANNEL_SKIP,
+  // the client is disconnected with code 1008
+  WS_CHANNEL_DISCONNECT,
+} AwsChannelLagPolicy;
+
+// what happens to an upgrade request when an AsyncWebSocket already has its max num of clients
+typedef enum {
+  // the request is answered with 503
+  WS_LIMIT_REJECT,
+  // the oldest client is disconnected to make room, without close handshake
+  WS_LIMIT_CLOSE_OLDEST,
+} AwsClientLimitPolicy;
 
 class AsyncWebSocketMessageBuffer {
   friend AsyncWebSocket;
@@ -188,8 +285,27 @@ class AsyncWebSocketMessage {
 
 private:
   size_t _remainingBytesToSend() const {
+    if (_filler) {
+      return _streamLength ? _streamLength - _sent : !_streamDone;
+    }
     return _WSbuffer->size() - _sent;
   }
+  // some bytes of the message were added to the TCP buffer: the rest must follow before any other frame
+  bool _started() const {
+    return _sent || _headerSent;
+  }
+  // payload length, 0 for a streamed message of unknown length
+  size_t _length() const {
+    return _WSbuffer ? _WSbuffer->size() : _streamLength;
+  }
+  // num of bytes held in memory by the message, streamed messages are not
+  size_t _queuedSize() const {
+    return _WSbuffer ? _WSbuffer->size() : 0;
+  }
+  // send the next bytes of a pre-encoded frame
+  size_t _sendEncoded(AsyncClient *client);
+  // produce and send the next chunk of a streamed message
+  size_t _sendStream(AsyncClient *client);
 
   AsyncWebSocketSharedBuffer _WSbuffer;
   uint8_t _opcode{WS_TEXT};
@@ -198,22 +314,66 @@ private:
   size_t _sent{};
   size_t _ack{};
   size_t _acked{};
+  // payload is compressed with permessage-deflate
+  bool _deflated{false};
+  // buffer holds a complete wire frame (header and payload) shared with other clients, sent as is
+  bool _encoded{false};
+  // queued with sendLatest(): replaced by a newer message with the same key until it starts being sent
+  bool _latest{false};
+  uint32_t _key{0};
+  // producer of a streamed message
+  AwsResponseFiller _filler;
+  // length of a streamed message sent as a single frame, 0 if it is sent as fragments until the producer returns 0
+  size_t _streamLength{0};
+  bool _streamDone{false};
+  // the producer ended before _streamLength bytes: the frame was completed with zeros
+  bool _streamFailed{false};
+  // the frame header of a stream of known length was added, possibly without any payload byte
+  bool _headerSent{false};
+  // buffer the producer writes to, allocated while the message is sent
+  std::unique_ptr<uint8_t[]> _chunk;
+  size_t _chunkSize{0};
 
 public:
-  AsyncWebSocketMessage(AsyncWebSocketSharedBuffer buffer, uint8_t opcode = WS_TEXT, bool mask = false);
+  AsyncWebSocketMessage(AsyncWebSocketSharedBuffer buffer, uint8_t opcode = WS_TEXT, bool mask = false, bool deflated = false, bool encoded = false);
+  AsyncWebSocketMessage(AwsResponseFiller filler, size_t len, uint8_t opcode);
 
   bool finished() const {
     return _status != WS_MSG_SENDING;
   }
   bool betweenFrames() const {
-    return _acked == _ack;
+    // a pre-encoded frame or a stream of known length is a single frame: nothing can be inserted before it is fully sent
+    return _acked == _ack && ((!_encoded && !_streamLength) || !_started());
   }
 
   size_t ack(size_t len, uint32_t time);
   size_t send(AsyncClient *client);
 };
 
+// message broadcast to several clients: the payload is compressed and the wire frames are encoded once, then shared by all the clients
+struct AsyncWebSocketBroadcastBuffer {
+  // payload compressed with permessage-deflate
+  AsyncWebSocketSharedBuffer deflated;
+  // window the payload was compressed with, 0 if compression was not attempted yet
+  uint8_t windowBits{0};
+  // encode the wire frames, not worth the copy of the payload when there is a single recipient
+  bool encode{false};
+  // frame holding the plain payload
+  AsyncWebSocketSharedBuffer frame;
+  // frame holding the compressed payload
+  AsyncWebSocketSharedBuffer deflatedFrame;
+};
+
+// keepalive deadline of a client in the timer wheel, stale once the client is rescheduled or gone
+struct AsyncWebSocketTimer {
+  uint32_t clientId;
+  uint32_t due;
+};
+
 class AsyncWebSocketClient {
+  friend AsyncWebSocket;
+  friend AsyncWebSocketChannel;
+
 private:
   AsyncClient *_client;
   AsyncWebSocket *_server;
@@ -223,19 +383,136 @@ private:
   uint32_t _lastMessageTime;
   uint32_t _keepAlivePeriod;
   mutable asyncsrv::mutex_type _queue_lock;
-  std::deque<AsyncWebSocketControl> _controlQueue;
-  std::deque<AsyncWebSocketMessage> _messageQueue;
-  bool _closeWhenFull = false;
+  // the storage of the queues is kept when the client slot is reused, see AsyncWebSocket::reserveClients()
+  AsyncRingQueue<AsyncWebSocketControl> _controlQueue{WS_CONTROL_QUEUE_SIZE};
+  // allocated for WS_MESSAGE_QUEUE_SIZE messages, it grows up to WS_MAX_QUEUED_MESSAGES if more are queued
+  // (one more for the rest of a channel frame, see _detachChannel())
+  AsyncRingQueue<AsyncWebSocketMessage> _messageQueue{WS_MESSAGE_QUEUE_SIZE};
+  // bytes added to the TCP buffer and not acked yet, by kind of frame in the order they were added: the acks are credited to them in that order
+  enum InFlightKind : uint8_t {
+    IN_FLIGHT_CONTROL,
+    IN_FLIGHT_MESSAGE,
+    IN_FLIGHT_CHANNEL
+  };
+  struct InFlight {
+    InFlightKind kind;
+    // one control frame, or the bytes of consecutive message (or channel) frames
+    size_t len;
+    InFlight(InFlightKind kind, size_t len) : kind(kind), len(len) {}
+  };
+  AsyncRingQueue<InFlight> _inFlight{WS_CONTROL_QUEUE_SIZE + 3};
+  AwsQueueFullPolicy _queueFullPolicy{WS_QUEUE_DROP_NEWEST};
+  // size of the messages in _messageQueue
+  size_t _queuedBytes{0};
+  // a message was discarded because the queue was full, WS_EVT_WRITABLE is sent once it drains
+  bool _writableWanted{false};
+  // the producer of a streamed message is running: the message queue is being iterated and must not change
+  bool _inProducer{false};
 
   AwsFrameInfo _pinfo;
 
+  // permessage-deflate window negotiated with the client, 0 if the extension is not used
+  uint8_t _deflateWindowBits{0};
+  // the message being received is compressed
+  bool _inflating{false};
+  // a protocol error occurred and the connection is closing: received frames are dropped, except the close frame
+  bool _discardFrames{false};
+  // compressed message being received
+  std::vector<uint8_t> _inflateInput;
+  // max size of the messages passed whole to the event handler, 0 to pass the frames as they are received
+  size_t _maxMessageSize{0};
+  // fragmented message being reassembled
+  std::vector<uint8_t> _rxMessage;
+  // max num of bytes passed to the event handler and not released by the app before TCP data stops being acknowledged, 0 for no limit
+  size_t _rxBudget{0};
+  // num of bytes passed to the event handler and not released yet
+  size_t _rxHeld{0};
+  // num of TCP bytes received and not acknowledged because of the receive budget
+  size_t _rxUnacked{0};
+  // topic patterns this client is subscribed to
+  std::vector<String> _topics;
+  // channel this client reads broadcast frames from, see AsyncWebSocketChannel
+  AsyncWebSocketChannel *_channel{nullptr};
+  // position of the next byte to send in the channel
+  uint64_t _channelCursor{0};
+  // num of bytes of the current channel frame not sent yet
+  size_t _channelFrameLeft{0};
+  // the queued messages are held to be sent together, since _holdSince
+  bool _holding{false};
+  uint32_t _holdSince{0};
+  // a frame could not be sent properly (streamed message ended early, channel frames lost): the connection is closed with this code
+  uint16_t _closeCode{0};
+  // num of bytes of the handshake response not acked yet, they were sent before the client took the connection over
+  size_t _handshakeUnacked{0};
+  // keepalive: time the last bytes were received, and the last message was received or sent
+  uint32_t _lastActivity;
+  uint32_t _lastDataTime;
+  // a keepalive ping (or a close frame after an idle timeout) was sent at _pingSentAt and its reply is awaited
+  bool _awaitingReply{false};
+  uint32_t _pingSentAt{0};
+  // sequence number carried by the keepalive pings, to match their pongs
+  uint32_t _pingSeq{0};
+  // round trip time measured with the last keepalive pong
+  uint32_t _rtt{0};
+  // deadline of the entry of this client in the server timer wheel, if _timerArmed
+  bool _timerArmed{false};
+  uint32_t _timerDue{0};
+
   bool _queueControl(uint8_t opcode, const uint8_t *data = NULL, size_t len = 0, bool mask = false);
-  bool _queueMessage(AsyncWebSocketSharedBuffer buffer, uint8_t opcode = WS_TEXT, bool mask = false);
+  bool _queueMessage(
+    AsyncWebSocketSharedBuffer buffer, uint8_t opcode = WS_TEXT, bool mask = false, AsyncWebSocketBroadcastBuffer *broadcast = nullptr, bool latest = false,
+    uint32_t key = 0
+  );
   void _runQueue();
   void _clearQueue();
+  // record @p len bytes of @p kind frames added to the TCP buffer, see _inFlight
+  void _addedInFlight(InFlightKind kind, size_t len);
+  // true if the message just queued should wait for the next ack to be sent with the following ones
+  bool _holdForBatch();
+  // send the pending frames of _channel, returns false if the client is mid-frame and more bytes are needed to complete it
+  bool _sendChannel();
+  // send what can be sent after new frames were added to _channel
+  void _flushChannel();
+  // stop reading _channel, the rest of a frame partially sent is queued as a message, must hold _queue_lock and _channel->_lock
+  void _detachChannel();
+  // close the connection with _closeCode, releasing @p lock on _queue_lock
+  void _closeOnError(asyncsrv::unique_lock_type &lock);
+  // true (and logs an error) if called from a stream producer, see _inProducer
+  bool _rejectInProducer() const;
+  // apply the queue limits and policy before queuing a message of @p len bytes, returns false if it cannot be queued
+  // (@p newMessage false: @p len more bytes for a message already queued, the limit on the num of messages does not apply)
+  bool _makeRoom(size_t len, asyncsrv::unique_lock_type &lock, bool newMessage = true);
+  // true if a message of @p len bytes can be queued without exceeding the queue limits
+  bool _queueHasRoom(size_t len, bool newMessage = true) const;
+  // latest-value message of @p key not started yet, nullptr if none
+  AsyncWebSocketMessage *_pendingLatest(uint32_t key);
+  // account for a message added to or removed from _messageQueue
+  void _messageQueued(size_t len);
+  void _messageDequeued(size_t len);
+  // discard the oldest message not sent yet, returns false if there is none
+  bool _dropOldestMessage();
+  // true if a message was discarded and the queue went below the low watermark since then
+  bool _checkWritable();
+  // update the status, keeping the server's count of connected clients in sync
+  void _setStatus(AwsClientStatus status);
+  // close the connection with @p code after a protocol error
+  void _failConnection(uint16_t code);
+  // pong received for a keepalive ping carrying @p seq
+  void _onKeepAlivePong(uint32_t seq);
+  // accumulate a compressed message and pass it to the event handler once complete and decompressed
+  void _handleDeflatedData(const uint8_t *data, size_t len);
+  // accumulate a message and pass it to the event handler once complete, without copy if it was received in a single piece
+  void _handleMessageData(uint8_t *data, size_t len, bool endOfPaquet);
+
+  // parse the frames of a TCP packet and pass their data to the event handler
+  void _handleFrames(uint8_t *data, size_t plen);
+  // pass received data to the event handler, accounting it in the receive budget
+  void _deliverData(uint8_t *data, size_t len);
 
   // this function is called when a text message is received, in order to copy the buffer and place a null terminator at the end of the buffer for easier handling of text messages.
   void _handleDataEvent(uint8_t *data, size_t len, bool endOfPaquet);
+  // pass received data to the event handler, null-terminated if it belongs to a text message
+  void _deliverTerminated(uint8_t *data, size_t len, bool endOfPaquet);
 
 public:
   void *_tempObject;
@@ -249,6 +526,8 @@ public:
    * @param server
    */
   AsyncWebSocketClient(AsyncWebServerRequest *request, AsyncWebSocket *server) : AsyncWebSocketClient(request->clientRelease(), server){};
+  // free client slot kept by the server to be reused (do not call)
+  explicit AsyncWebSocketClient(AsyncWebSocket *server);
   ~AsyncWebSocketClient();
 
   // client id increments for the given server
@@ -273,6 +552,38 @@ public:
   AwsFrameInfo const &pinfo() const {
     return _pinfo;
   }
+  // true if permessage-deflate compression was negotiated with this client
+  bool perMessageDeflate() const {
+    return _deflateWindowBits != 0;
+  }
+
+  /**
+   * @brief Set the max size of the messages received from this client when message reassembly is used, see AsyncWebSocket::enableMessageReassembly()
+   * @param maxMessageSize max size of a message, a bigger one closes the connection with code 1009. 0 disables the reassembly for this client.
+   */
+  void setMaxMessageSize(size_t maxMessageSize) {
+    _maxMessageSize = maxMessageSize;
+  }
+  size_t maxMessageSize() const {
+    return _maxMessageSize;
+  }
+
+  /**
+   * @brief Set the receive budget of this client, see AsyncWebSocket::setReceiveBudget()
+   * @param budget max num of received bytes the app can hold without releasing them, 0 for no limit
+   */
+  void setReceiveBudget(size_t budget);
+  size_t receiveBudget() const {
+    return _rxBudget;
+  }
+  /**
+   * @brief Release @p len bytes of the data passed to the event handler, once the app has processed them
+   * Only needed with a receive budget: TCP data is acknowledged again once the bytes held go below the budget.
+   * Can be called from any task.
+   */
+  void release(size_t len);
+  // num of received bytes passed to the event handler and not released yet
+  size_t heldBytes() const;
 
   // CloseClientOnQueueFull:
   //
@@ -303,10 +614,21 @@ public:
   //
   // When the queue is full, a message is logged in case it is discarded.
   void setCloseClientOnQueueFull(bool close) {
-    _closeWhenFull = close;
+    _queueFullPolicy = close ? WS_QUEUE_CLOSE : WS_QUEUE_DROP_NEWEST;
   }
   bool willCloseClientOnQueueFull() const {
-    return _closeWhenFull;
+    return _queueFullPolicy == WS_QUEUE_CLOSE;
+  }
+
+  // Finer grained version of setCloseClientOnQueueFull(), see AwsQueueFullPolicy.
+  // The queue is full when it holds WS_MAX_QUEUED_MESSAGES messages, or when a byte budget set with AsyncWebSocket::setMaxQueuedBytes() is exhausted.
+  // WS_QUEUE_BLOCK only waits on platforms using mutexes (ESP32), and never in the event handler or any other AsyncTCP callback (acks cannot
+  // be processed while waiting there) nor in the sends of AsyncWebSocket (textAll(), publish()...: all the clients are locked meanwhile).
+  void setQueueFullPolicy(AwsQueueFullPolicy policy) {
+    _queueFullPolicy = policy;
+  }
+  AwsQueueFullPolicy queueFullPolicy() const {
+    return _queueFullPolicy;
   }
 
   IPAddress remoteIP() const;
@@ -327,13 +649,66 @@ public:
   uint16_t keepAlivePeriod() {
     return (uint16_t)(_keepAlivePeriod / 1000);
   }
+  // round trip time in ms measured with the last keepalive ping, 0 if none was answered yet, see AsyncWebSocket::setKeepAlive()
+  uint32_t rtt() const {
+    return _rtt;
+  }
+  // millis() when data was last received from the client
+  uint32_t lastActivity() const {
+    return _lastActivity;
+  }
 
   // data packets
   bool message(AsyncWebSocketSharedBuffer buffer, uint8_t opcode = WS_TEXT, bool mask = false) {
     return _queueMessage(buffer, opcode, mask);
   }
+
+  /**
+   * @brief Queue a message replacing the one previously queued with the same @p key, as long as that one was not sent yet
+   * Meant for state snapshots produced faster than a slow client receives them: instead of filling the queue with stale snapshots,
+   * the client gets the latest one, and a client keeping up receives all of them.
+   * The replaced message keeps its position in the queue, relative to the other messages.
+   */
+  bool sendLatest(uint32_t key, AsyncWebSocketSharedBuffer buffer, uint8_t opcode = WS_TEXT) {
+    return _queueMessage(buffer, opcode, false, nullptr, true, key);
+  }
+  bool sendLatest(uint32_t key, const uint8_t *message, size_t len, uint8_t opcode = WS_TEXT);
+  bool sendLatest(uint32_t key, const String &message);
+
+  /**
+   * @brief Receive the messages published on @p topic with AsyncWebSocket::publish()
+   * A pattern ending with "#" after a "/" is a wildcard: "sensors/#" matches "sensors", "sensors/temp" and "sensors/temp/max", "#" matches all the topics.
+   * @return false if the client is not connected
+   */
+  bool subscribe(const String &topic);
+  void unsubscribe(const String &topic);
+  void unsubscribeAll();
+  // true if the client is subscribed to this exact pattern
+  bool subscribed(const String &topic) const;
+
+  /**
+   * @brief Send a message produced chunk by chunk as TCP space becomes available, instead of holding it whole in memory
+   * @param filler writes up to maxLen bytes to the buffer, index being the num of bytes already produced, and returns the num of bytes written,
+   * 0 at the end of the message or RESPONSE_TRY_AGAIN if no data is available yet
+   * @param len length of the message if known, it is then sent as a single frame: the producer must provide exactly @p len bytes,
+   * if it ends early the frame is completed with zeros and the connection closed with code 1011.
+   * If 0 the message is sent as fragments until the producer returns 0.
+   * @note streamed messages are not compressed
+   * @note the producer is called with the queue of the client locked: it must not send messages to any client (text(), stream(), textAll()...),
+   * such calls to this client fail. Control frames (close(), ping()) are queued and sent between frames as usual.
+   */
+  bool stream(AwsResponseFiller filler, size_t len = 0, uint8_t opcode = WS_BINARY);
+  /**
+   * @brief Send @p len bytes read from @p source as a single frame, the data is waited for while the source has none available
+   * @note @p source must remain valid until the message is sent. A Stream has no end of stream: @p len is required, 0 is rejected
+   */
+  bool stream(Stream &source, size_t len, uint8_t opcode = WS_BINARY);
+  // send the remaining content of @p file, the file is closed once sent
+  bool stream(fs::File file, uint8_t opcode = WS_BINARY);
   bool queueIsFull() const;
   size_t queueLen() const;
+  // num of bytes of the messages queued for this client and not acked yet
+  size_t queuedBytes() const;
 
   size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
 
@@ -357,6 +732,8 @@ public:
   void _onAck(size_t len, uint32_t time);
   void _onError(int8_t);
   void _onPoll();
+  // run the queue on poll and send the per-client keepalive pings
+  void _pollQueue();
   void _onTimeout(uint32_t time);
   void _onDisconnect();
   void _onData(void *pbuf, size_t plen);
@@ -373,14 +750,54 @@ using AwsEventHandler = std::function<void(AsyncWebSocket *server, AsyncWebSocke
 
 // WebServer Handler implementation that plays the role of a socket server
 class AsyncWebSocket : public AsyncWebHandler {
+  friend AsyncWebSocketClient;
+  friend AsyncWebSocketResponse;
+
 private:
   String _url;
   std::list<AsyncWebSocketClient> _clients;
+  // index of _clients by client id
+  std::unordered_map<uint32_t, std::list<AsyncWebSocketClient>::iterator> _clientsById;
+  // free client slots, moved to _clients on connect and back on disconnect so that the list nodes and queues are not reallocated
+  std::list<AsyncWebSocketClient> _clientPool;
+  size_t _clientPoolSize{WS_CLIENT_POOL_SIZE};
+  size_t _maxClients{WS_MAX_CLIENTS};
+  AwsClientLimitPolicy _clientLimitPolicy{WS_LIMIT_REJECT};
+  // num of AsyncWebSocketResponse alive, i.e. handshakes in progress
+  size_t _pendingClients{0};
+  // subscribers of the exact topics, and of the wildcard patterns indexed by their prefix ("sensors/" for "sensors/#")
+  std::map<String, std::vector<AsyncWebSocketClient *>> _topicSubscribers;
+  std::map<String, std::vector<AsyncWebSocketClient *>> _prefixSubscribers;
+  // num of clients in WS_CONNECTED status
+  size_t _connectedClients{0};
+  // num of bytes queued for all the clients
+  size_t _queuedBytes{0};
+  // guards the counters updated by the clients without holding _ws_clients_lock
+  mutable asyncsrv::mutex_type _counters_lock;
   uint32_t _cNextId;
   AwsEventHandler _eventHandler;
   AwsHandshakeHandler _handshakeHandler;
   bool _enabled;
   mutable asyncsrv::mutex_type _ws_clients_lock;
+  // permessage-deflate window offered to the clients, 0 if disabled
+  uint8_t _deflateWindowBits{0};
+  size_t _deflateThreshold{WS_DEFLATE_THRESHOLD};
+  // max size of the reassembled messages for the clients connecting afterwards, 0 if disabled
+  size_t _maxMessageSize{0};
+  size_t _rxBudget{WS_RECEIVE_BUDGET};
+  size_t _maxQueuedBytes{WS_MAX_QUEUED_BYTES};
+  size_t _maxQueuedBytesTotal{WS_MAX_QUEUED_BYTES_TOTAL};
+  size_t _queueLowWatermark{0};
+  uint32_t _flushDelay{WS_FLUSH_DELAY};
+  uint32_t _pingInterval{WS_PING_INTERVAL};
+  uint32_t _pongTimeout{WS_PONG_TIMEOUT};
+  uint32_t _idleTimeout{WS_IDLE_TIMEOUT};
+  // keepalive deadlines of the clients, allocated when the keepalive is enabled, guarded by _ws_clients_lock
+  std::vector<std::vector<AsyncWebSocketTimer>> _timerWheel;
+  // slot being processed, swapped with the slot so that its entries can be rescheduled meanwhile
+  std::vector<AsyncWebSocketTimer> _timerFired;
+  // last tick of WS_TIMER_WHEEL_RESOLUTION ms processed
+  uint32_t _timerTick{0};
 
 public:
   typedef enum {
@@ -401,6 +818,130 @@ public:
   bool enabled() const {
     return _enabled;
   }
+
+  /**
+   * @brief Enable or disable the permessage-deflate extension (RFC 7692) for the clients connecting afterwards
+   * Outgoing messages are compressed once, even when broadcast, and sent uncompressed if smaller than @p threshold or if compression does not save space.
+   * Compressed messages received from the clients are decompressed (up to WS_DEFLATE_MAX_MESSAGE_SIZE bytes) and passed to the event handler as a single frame.
+   * No compression context is kept between messages.
+   * @param threshold minimum size of the messages to compress
+   * @param windowBits base-2 logarithm of the LZ77 window (8 to 15) used to compress, a bigger window compresses better but uses more RAM
+   */
+  void enablePerMessageDeflate(bool enable, size_t threshold = WS_DEFLATE_THRESHOLD, uint8_t windowBits = WS_DEFLATE_WINDOW_BITS);
+  bool perMessageDeflate() const {
+    return _deflateWindowBits != 0;
+  }
+
+  /**
+   * @brief Enable or disable the reassembly of the received messages for the clients connecting afterwards
+   * The event handler then gets each text or binary message at once, as a single frame with info->index == 0 and info->len == len, whatever the
+   * way it was fragmented by the client or split by TCP. A message received in a single piece is passed without copy, the others are buffered.
+   * As in the other modes, a text message is null-terminated (data[len] == 0), a binary one is not necessarily.
+   * @param maxMessageSize max size of a message, a bigger one closes the connection with code 1009 as soon as its frame header is received
+   */
+  void enableMessageReassembly(bool enable, size_t maxMessageSize = WS_MAX_MESSAGE_SIZE) {
+    _maxMessageSize = enable ? maxMessageSize : 0;
+  }
+  size_t maxMessageSize() const {
+    return _maxMessageSize;
+  }
+
+  /**
+   * @brief Set the receive budget of the clients connecting afterwards, to push back on clients sending faster than the app can process
+   * Once the app holds @p budget bytes passed by WS_EVT_DATA and not released with AsyncWebSocketClient::release(), the TCP data received from
+   * the client is not acknowledged anymore: the TCP window closes and the client has to wait. It is acknowledged again once enough bytes are released.
+   * Up to one TCP window can be received beyond the budget.
+   * @param budget max num of bytes held by the app, 0 for no limit (the data is acknowledged as soon as it is passed to the event handler)
+   */
+  void setReceiveBudget(size_t budget) {
+    _rxBudget = budget;
+  }
+  size_t receiveBudget() const {
+    return _rxBudget;
+  }
+
+  /**
+   * @brief Limit the num of bytes queued for sending, on top of WS_MAX_QUEUED_MESSAGES
+   * A message exceeding a budget is handled according to the client's AwsQueueFullPolicy.
+   * A message larger than @p perClient is still accepted when the client's queue is empty.
+   * @param perClient budget of each client, 0 for no limit
+   * @param total budget of all the clients together, 0 for no limit. A broadcast message counts once per client.
+   */
+  void setMaxQueuedBytes(size_t perClient, size_t total = 0) {
+    _maxQueuedBytes = perClient;
+    _maxQueuedBytesTotal = total;
+  }
+  size_t maxQueuedBytes() const {
+    return _maxQueuedBytes;
+  }
+  size_t maxQueuedBytesTotal() const {
+    return _maxQueuedBytesTotal;
+  }
+  /**
+   * @brief Set the queue size, in bytes, under which WS_EVT_WRITABLE is sent to a client which had a message discarded.
+   * Defaults to half of the per-client budget, and WS_MAX_QUEUED_MESSAGES / 2 messages must be queued at most too.
+   */
+  void setQueueLowWatermark(size_t bytes) {
+    _queueLowWatermark = bytes;
+  }
+  /**
+   * @brief Hold the messages queued while the previous ones are not acked yet, for up to @p ms milliseconds, so that they are sent together
+   * The queued frames are always packed into the TCP buffer and pushed with a single send(), this also batches the frames of messages queued in a row.
+   * @param ms max delay, 0 to send each message as soon as it is queued
+   */
+  void setFlushDelay(uint32_t ms) {
+    _flushDelay = ms;
+  }
+  uint32_t flushDelay() const {
+    return _flushDelay;
+  }
+  /**
+   * @brief Ping the clients and close the dead or idle ones
+   * A client is pinged after @p pingInterval ms without receiving anything from it, and its connection is closed if the pong does not come within
+   * @p pongTimeout ms. A client that did not send nor receive any message for @p idleTimeout ms is closed with code 1001.
+   * The deadlines are kept in a timer wheel advanced by the poll of the clients and by cleanupClients(), so a deadline may be checked up to
+   * a poll interval late. Unlike the per-client keepAlivePeriod(), the pings carry a sequence number and their round trip time is measured, see
+   * AsyncWebSocketClient::rtt().
+   * @param pingInterval in ms, 0 to disable the pings
+   * @param pongTimeout in ms
+   * @param idleTimeout in ms, 0 to disable the idle close
+   */
+  void setKeepAlive(uint32_t pingInterval, uint32_t pongTimeout = WS_PONG_TIMEOUT, uint32_t idleTimeout = WS_IDLE_TIMEOUT);
+  uint32_t pingInterval() const {
+    return _pingInterval;
+  }
+  uint32_t pongTimeout() const {
+    return _pongTimeout;
+  }
+  uint32_t idleTimeout() const {
+    return _idleTimeout;
+  }
+  /**
+   * @brief Allocate @p count client slots now and keep up to @p count slots after the clients disconnect
+   * A connecting client takes a free slot, with the storage of its queues already allocated, and gives it back when it disconnects:
+   * reconnection storms do not allocate nor fragment the heap for the clients. Up to WS_CLIENT_POOL_SIZE slots are kept by default,
+   * but they are only allocated when clients connect.
+   * A slot holds the client object and its queues, allocated for WS_MESSAGE_QUEUE_SIZE messages and WS_CONTROL_QUEUE_SIZE control frames:
+   * a queue that grew keeps its storage for the next client.
+   * @return false if the slots could not be allocated
+   */
+  bool reserveClients(size_t count);
+  /**
+   * @brief Limit the num of clients, counting the handshakes in progress, checked before the handshake response and the client are allocated
+   * Unlike cleanupClients(), which closes the oldest client after a new one was accepted, the limit is never exceeded.
+   * The num of client slots kept for reuse follows the limit, see reserveClients().
+   * @param max max num of clients, 0 for no limit
+   * @param policy WS_LIMIT_REJECT to answer the upgrade requests over the limit with 503, WS_LIMIT_CLOSE_OLDEST to disconnect the oldest client instead
+   */
+  void setMaxClients(size_t max, AwsClientLimitPolicy policy = WS_LIMIT_REJECT);
+  size_t maxClients() const {
+    return _maxClients;
+  }
+  // num of free client slots
+  size_t freeClientSlots() const;
+  // num of bytes queued for all the clients
+  size_t queuedBytes() const;
+
   bool availableForWriteAll();
   bool availableForWrite(uint32_t id);
 
@@ -445,6 +986,16 @@ public:
   SendStatus binaryAll(AsyncWebSocketMessageBuffer *buffer);
   SendStatus binaryAll(AsyncWebSocketSharedBuffer buffer);
 
+  // AsyncWebSocketClient::sendLatest() for all the clients, the message is compressed and encoded once
+  SendStatus sendLatestAll(uint32_t key, AsyncWebSocketSharedBuffer buffer, uint8_t opcode = WS_TEXT);
+  SendStatus sendLatestAll(uint32_t key, const uint8_t *message, size_t len, uint8_t opcode = WS_TEXT);
+  SendStatus sendLatestAll(uint32_t key, const String &message);
+
+  // send a message to the clients subscribed to @p topic (see AsyncWebSocketClient::subscribe()), the message is compressed and encoded once
+  SendStatus publish(const String &topic, AsyncWebSocketSharedBuffer buffer, uint8_t opcode = WS_TEXT);
+  SendStatus publish(const String &topic, const uint8_t *message, size_t len, uint8_t opcode = WS_TEXT);
+  SendStatus publish(const String &topic, const String &message);
+
   size_t printf(uint32_t id, const char *format, ...) __attribute__((format(printf, 3, 4)));
   size_t printfAll(const char *format, ...) __attribute__((format(printf, 2, 3)));
 
@@ -468,8 +1019,24 @@ public:
   uint32_t _getNextId() {
     return _cNextId++;
   }
-  AsyncWebSocketClient *_newClient(AsyncWebServerRequest *request);
+  // @p handshakeLen bytes of handshake response were added to the TCP buffer and are pushed with the first frames
+  AsyncWebSocketClient *_newClient(AsyncWebServerRequest *request, uint8_t deflateWindowBits = 0, size_t handshakeLen = 0);
   void _handleDisconnect(AsyncWebSocketClient *client);
+  // remove a client from the list and the index, its slot goes to the pool if there is room
+  void _eraseClient(std::list<AsyncWebSocketClient>::iterator client);
+  // true if a new client can be accepted, after disconnecting the oldest one with WS_LIMIT_CLOSE_OLDEST
+  bool _makeRoomForClient();
+  // construct @p slot again in place for @p request, or as a free slot if null, keeping the storage of its queues
+  void _rebuildClient(AsyncWebSocketClient &slot, AsyncWebServerRequest *request);
+  // add the next keepalive deadline of @p client to the timer wheel, must hold _ws_clients_lock
+  void _scheduleTimer(AsyncWebSocketClient *client);
+  // process the keepalive deadlines elapsed since the last call
+  void _runTimers();
+  // ping or close @p client if one of its keepalive deadlines elapsed, then reschedule it, must hold _ws_clients_lock
+  void _runTimer(AsyncWebSocketClient *client, uint32_t now);
+  friend AsyncWebSocketChannel;
+  void _subscribe(AsyncWebSocketClient *client, const String &topic);
+  void _unsubscribe(AsyncWebSocketClient *client, const String &topic);
   void _handleEvent(AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len);
   bool canHandle(AsyncWebServerRequest *request) const final;
   void handleRequest(AsyncWebServerRequest *request) final;
@@ -483,17 +1050,83 @@ public:
   }
 };
 
+/**
+ * @brief Broadcast channel for high rate streams: the frames are encoded once into a ring of fixed size and each subscribed client only holds a cursor in it
+ * Publishing does not allocate and does not queue anything per client, whatever the num of clients: the clients send the frames straight from the ring.
+ * A client falling behind by more than the ring size loses the frames overwritten, and is handled according to the AwsChannelLagPolicy.
+ * The channel frames of a client are sent after the messages queued for it, and a client can subscribe to one channel at a time.
+ */
+class AsyncWebSocketChannel {
+  friend AsyncWebSocketClient;
+  friend AsyncWebSocket;
+
+private:
+  AsyncWebSocket *_server;
+  std::unique_ptr<uint8_t[]> _ring;
+  size_t _capacity;
+  AwsChannelLagPolicy _lagPolicy;
+  // positions of the oldest frame and of the end of the newest frame, counted in bytes since the channel creation
+  uint64_t _start{0};
+  uint64_t _end{0};
+  // guarded by the server's _ws_clients_lock
+  std::vector<AsyncWebSocketClient *> _subscribers;
+  // guards the ring and its positions, taken after the client's _queue_lock
+  mutable asyncsrv::mutex_type _lock;
+
+  // size of the whole frame starting at @p pos
+  size_t _frameSize(uint64_t pos) const;
+  void _copyIn(uint64_t pos, const uint8_t *data, size_t len);
+  void _copyOut(uint64_t pos, uint8_t *data, size_t len) const;
+  // add up to @p len bytes starting at @p pos to the TCP buffer, returns the num of bytes added
+  size_t _addTo(AsyncClient *client, uint64_t pos, size_t len) const;
+  void _removeSubscriber(AsyncWebSocketClient *client);
+
+public:
+  /**
+   * @param capacity size of the ring in bytes, headers included: it must hold at least the largest frame, and the more frames it holds the
+   * further behind a client can fall before losing frames
+   */
+  AsyncWebSocketChannel(AsyncWebSocket &server, size_t capacity, AwsChannelLagPolicy lagPolicy = WS_CHANNEL_SKIP);
+  ~AsyncWebSocketChannel();
+  AsyncWebSocketChannel(const AsyncWebSocketChannel &) = delete;
+  AsyncWebSocketChannel &operator=(const AsyncWebSocketChannel &) = delete;
+
+  /**
+   * @brief Subscribe a client of the server: it receives the frames published from now on
+   * @return false if the client is subscribed to another channel or the ring could not be allocated
+   */
+  bool subscribe(AsyncWebSocketClient *client);
+  void unsubscribe(AsyncWebSocketClient *client);
+  // num of subscribed clients
+  size_t count() const;
+
+  /**
+   * @brief Publish a message to the subscribed clients
+   * @return false if the frame does not fit in the ring
+   */
+  bool publish(const uint8_t *data, size_t len, uint8_t opcode = WS_BINARY);
+  bool binary(const uint8_t *data, size_t len) {
+    return publish(data, len, WS_BINARY);
+  }
+  bool text(const char *message, size_t len) {
+    return publish((const uint8_t *)message, len, WS_TEXT);
+  }
+  bool text(const String &message) {
+    return text(message.c_str(), message.length());
+  }
+};
+
 // WebServer response to authenticate the socket and detach the tcp client from the web server request
 class AsyncWebSocketResponse : public AsyncWebServerResponse {
 private:
   String _content;
   AsyncWebSocket *_server;
-  AsyncWebServerRequest *_request;
-  // this call back will switch AsyncTCP client to WebSocket
-  void _switchClient();
+  // permessage-deflate window negotiated with the client, 0 if the extension is not used
+  uint8_t _deflateWindowBits;
 
 public:
-  AsyncWebSocketResponse(const String &key, AsyncWebSocket *server);
+  AsyncWebSocketResponse(const String &key, AsyncWebSocket *server, uint8_t deflateWindowBits = 0);
+  ~AsyncWebSocketResponse();
   void _respond(AsyncWebServerRequest *request) override;
   size_t _ack(AsyncWebServerRequest *request, size_t len, uint32_t time) override {
     return 0;
@@ -528,7 +1161,8 @@ public:
 
   /**
    * Complete message callback
-   * @param data pointer to the data (binary or null-terminated string). This handler expects the user to know which data type he uses.
+   * @param data pointer to the data (binary, or null-terminated string for a text message, also with message reassembly).
+   * This handler expects the user to know which data type he uses.
    */
   void onMessage(std::function<void(AsyncWebSocket *server, AsyncWebSocketClient *client, const uint8_t *data, size_t len)> onMessage) {
     _onMessage = onMessage;
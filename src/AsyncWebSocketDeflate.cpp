@@ -0,0 +1,501 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright 2016-2026 Hristo Gochkov, Mathieu Carbou, Emil Muratov, Will Miles
+
+#include "AsyncWebSocketDeflate.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+
+#define WS_DEFLATE_MIN_MATCH 3
+#define WS_DEFLATE_MAX_MATCH 258
+// max number of previous strings compared when looking for a match
+#define WS_DEFLATE_MAX_CHAIN 32
+// a 3 bytes match further than this costs more than the literals
+#define WS_DEFLATE_TOO_FAR 4096
+#define WS_DEFLATE_MAX_HASH_BITS 10
+
+namespace {
+
+// RFC 1951 section 3.2.5
+const uint16_t lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t distBase[30] = {1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+                               193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const uint8_t distExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+// order of the code length code lengths in a dynamic block header
+const uint8_t codeLengthOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+/*
+ * Compression
+ */
+
+class BitWriter {
+private:
+  uint8_t *_out;
+  size_t _capacity;
+  size_t _len{0};
+  uint32_t _acc{0};
+  uint8_t _count{0};
+  bool _overflow{false};
+
+public:
+  BitWriter(uint8_t *out, size_t capacity) : _out(out), _capacity(capacity) {}
+
+  size_t length() const {
+    return _len;
+  }
+  // true if the output did not fit in the buffer
+  bool overflow() const {
+    return _overflow;
+  }
+
+  // write the @p count low bits of @p value, least significant bit first
+  void bits(uint32_t value, uint8_t count) {
+    _acc |= value << _count;
+    _count += count;
+    while (_count >= 8) {
+      if (_len < _capacity) {
+        _out[_len++] = _acc & 0xff;
+      } else {
+        _overflow = true;
+      }
+      _acc >>= 8;
+      _count -= 8;
+    }
+  }
+
+  // Huffman codes are packed starting with their most significant bit
+  void code(uint32_t code, uint8_t count) {
+    uint32_t reversed = 0;
+    for (uint8_t i = 0; i < count; i++) {
+      reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    bits(reversed, count);
+  }
+
+  // pad the last byte with zeros
+  void flush() {
+    if (_count) {
+      bits(0, 8 - _count);
+    }
+  }
+};
+
+// literal/length symbol with the fixed Huffman codes of RFC 1951 section 3.2.6
+void writeSymbol(BitWriter &w, uint16_t symbol) {
+  if (symbol < 144) {
+    w.code(0x30 + symbol, 8);
+  } else if (symbol < 256) {
+    w.code(0x190 + symbol - 144, 9);
+  } else if (symbol < 280) {
+    w.code(symbol - 256, 7);
+  } else {
+    w.code(0xc0 + symbol - 280, 8);
+  }
+}
+
+void writeMatch(BitWriter &w, size_t length, size_t distance) {
+  uint8_t l = 28;
+  while (lengthBase[l] > length) {
+    l--;
+  }
+  writeSymbol(w, 257 + l);
+  w.bits(length - lengthBase[l], lengthExtra[l]);
+
+  uint8_t d = 29;
+  while (distBase[d] > distance) {
+    d--;
+  }
+  w.code(d, 5);
+  w.bits(distance - distBase[d], distExtra[d]);
+}
+
+inline uint32_t hash3(const uint8_t *p, uint8_t hashBits) {
+  return ((uint32_t(p[0]) << 16 | uint32_t(p[1]) << 8 | p[2]) * 2654435761u) >> (32 - hashBits);
+}
+
+/*
+ * Decompression
+ */
+
+struct Huffman {
+  uint16_t count[16];    // number of codes of each length
+  uint16_t symbol[288];  // symbols ordered by code
+};
+
+struct InflateTables {
+  Huffman lencode;
+  Huffman distcode;
+};
+
+class BitReader {
+private:
+  const uint8_t *_data;
+  size_t _len;
+  size_t _pos{0};
+  uint32_t _acc{0};
+  uint8_t _count{0};
+  bool _error{false};
+
+public:
+  BitReader(const uint8_t *data, size_t len) : _data(data), _len(len) {}
+
+  // true if reading past the end of the input was attempted
+  bool error() const {
+    return _error;
+  }
+  bool hasMore() const {
+    return _pos < _len;
+  }
+
+  // read @p count bits (at most 16), least significant bit first
+  uint32_t bits(uint8_t count) {
+    while (_count < count) {
+      if (_pos == _len) {
+        _error = true;
+        return 0;
+      }
+      _acc |= uint32_t(_data[_pos++]) << _count;
+      _count += 8;
+    }
+    const uint32_t value = _acc & ((1u << count) - 1);
+    _acc >>= count;
+    _count -= count;
+    return value;
+  }
+
+  // skip the remaining bits of the current byte
+  void align() {
+    _acc = 0;
+    _count = 0;
+  }
+
+  // consume @p len bytes once aligned, returns nullptr if not available
+  const uint8_t *take(size_t len) {
+    if (_len - _pos < len) {
+      _error = true;
+      return nullptr;
+    }
+    const uint8_t *p = _data + _pos;
+    _pos += len;
+    return p;
+  }
+};
+
+// build canonical Huffman decoding tables from code lengths, returns false if the lengths are over-subscribed
+bool buildHuffman(Huffman &h, const uint8_t *length, size_t n) {
+  memset(h.count, 0, sizeof(h.count));
+  for (size_t i = 0; i < n; i++) {
+    h.count[length[i]]++;
+  }
+  if (h.count[0] == n) {
+    return true;
+  }
+
+  int left = 1;
+  for (uint8_t len = 1; len < 16; len++) {
+    left <<= 1;
+    left -= h.count[len];
+    if (left < 0) {
+      return false;
+    }
+  }
+
+  uint16_t offset[16];
+  offset[1] = 0;
+  for (uint8_t len = 1; len < 15; len++) {
+    offset[len + 1] = offset[len] + h.count[len];
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (length[i]) {
+      h.symbol[offset[length[i]]++] = i;
+    }
+  }
+  return true;
+}
+
+int decodeSymbol(BitReader &r, const Huffman &h) {
+  int code = 0;
+  int first = 0;
+  int index = 0;
+  for (uint8_t len = 1; len < 16; len++) {
+    code |= r.bits(1);
+    if (r.error()) {
+      return -1;
+    }
+    const int count = h.count[len];
+    if (code - count < first) {
+      return h.symbol[index + (code - first)];
+    }
+    index += count;
+    first += count;
+    first <<= 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+asyncsrv::WsInflateStatus inflateStored(BitReader &r, std::vector<uint8_t> &out, size_t maxSize) {
+  r.align();
+  const uint8_t *header = r.take(4);
+  if (!header) {
+    return asyncsrv::WS_INFLATE_ERROR;
+  }
+  const size_t len = header[0] | (header[1] << 8);
+  const size_t nlen = header[2] | (header[3] << 8);
+  if (nlen != (~len & 0xffff)) {
+    return asyncsrv::WS_INFLATE_ERROR;
+  }
+  const uint8_t *data = r.take(len);
+  if (!data) {
+    return asyncsrv::WS_INFLATE_ERROR;
+  }
+  if (out.size() + len > maxSize) {
+    return asyncsrv::WS_INFLATE_TOO_LARGE;
+  }
+  out.insert(out.end(), data, data + len);
+  return asyncsrv::WS_INFLATE_OK;
+}
+
+asyncsrv::WsInflateStatus inflateCodes(BitReader &r, std::vector<uint8_t> &out, size_t maxSize, const InflateTables &t) {
+  for (;;) {
+    int symbol = decodeSymbol(r, t.lencode);
+    if (symbol < 0) {
+      return asyncsrv::WS_INFLATE_ERROR;
+    }
+    if (symbol < 256) {
+      if (out.size() >= maxSize) {
+        return asyncsrv::WS_INFLATE_TOO_LARGE;
+      }
+      out.push_back(symbol);
+      continue;
+    }
+    if (symbol == 256) {
+      return asyncsrv::WS_INFLATE_OK;
+    }
+
+    symbol -= 257;
+    if (symbol >= 29) {
+      return asyncsrv::WS_INFLATE_ERROR;
+    }
+    const size_t length = lengthBase[symbol] + r.bits(lengthExtra[symbol]);
+    symbol = decodeSymbol(r, t.distcode);
+    if (symbol < 0 || symbol >= 30) {
+      return asyncsrv::WS_INFLATE_ERROR;
+    }
+    const size_t distance = distBase[symbol] + r.bits(distExtra[symbol]);
+    if (r.error() || distance > out.size()) {
+      return asyncsrv::WS_INFLATE_ERROR;
+    }
+    if (out.size() + length > maxSize) {
+      return asyncsrv::WS_INFLATE_TOO_LARGE;
+    }
+    // the match may overlap the bytes it produces, so it has to be copied byte by byte
+    const size_t from = out.size() - distance;
+    for (size_t i = 0; i < length; i++) {
+      const uint8_t c = out[from + i];
+      out.push_back(c);
+    }
+  }
+}
+
+asyncsrv::WsInflateStatus inflateFixed(BitReader &r, std::vector<uint8_t> &out, size_t maxSize, InflateTables &t) {
+  uint8_t lengths[288];
+  memset(lengths, 8, 144);
+  memset(lengths + 144, 9, 112);
+  memset(lengths + 256, 7, 24);
+  memset(lengths + 280, 8, 8);
+  buildHuffman(t.lencode, lengths, 288);
+  memset(lengths, 5, 30);
+  buildHuffman(t.distcode, lengths, 30);
+  return inflateCodes(r, out, maxSize, t);
+}
+
+asyncsrv::WsInflateStatus inflateDynamic(BitReader &r, std::vector<uint8_t> &out, size_t maxSize, InflateTables &t) {
+  const size_t nlen = r.bits(5) + 257;
+  const size_t ndist = r.bits(5) + 1;
+  const size_t ncode = r.bits(4) + 4;
+  if (r.error() || nlen > 286 || ndist > 30) {
+    return asyncsrv::WS_INFLATE_ERROR;
+  }
+
+  uint8_t lengths[286 + 30] = {};
+  for (size_t i = 0; i < ncode; i++) {
+    lengths[codeLengthOrder[i]] = r.bits(3);
+  }
+  if (r.error() || !buildHuffman(t.lencode, lengths, 19)) {
+    return asyncsrv::WS_INFLATE_ERROR;
+  }
+
+  size_t index = 0;
+  while (index < nlen + ndist) {
+    const int symbol = decodeSymbol(r, t.lencode);
+    if (symbol < 0) {
+      return asyncsrv::WS_INFLATE_ERROR;
+    }
+    if (symbol < 16) {
+      lengths[index++] = symbol;
+      continue;
+    }
+    uint8_t len = 0;
+    size_t repeat;
+    if (symbol == 16) {
+      if (index == 0) {
+        return asyncsrv::WS_INFLATE_ERROR;
+      }
+      len = lengths[index - 1];
+      repeat = 3 + r.bits(2);
+    } else if (symbol == 17) {
+      repeat = 3 + r.bits(3);
+    } else {
+      repeat = 11 + r.bits(7);
+    }
+    if (r.error() || index + repeat > nlen + ndist) {
+      return asyncsrv::WS_INFLATE_ERROR;
+    }
+    memset(lengths + index, len, repeat);
+    index += repeat;
+  }
+
+  // the end-of-block code is mandatory
+  if (lengths[256] == 0 || !buildHuffman(t.lencode, lengths, nlen) || !buildHuffman(t.distcode, lengths + nlen, ndist)) {
+    return asyncsrv::WS_INFLATE_ERROR;
+  }
+  return inflateCodes(r, out, maxSize, t);
+}
+
+}  // namespace
+
+namespace asyncsrv {
+
+std::shared_ptr<std::vector<uint8_t>> wsDeflate(const uint8_t *data, size_t len, uint8_t windowBits) {
+  // even a perfect match costs more than 3 bytes of header and trailer
+  if (len <= WS_DEFLATE_MIN_MATCH + 1) {
+    return nullptr;
+  }
+
+  windowBits = std::min(std::max(windowBits, (uint8_t)8), (uint8_t)15);
+  const size_t windowSize = (size_t)1 << windowBits;
+  const size_t windowMask = windowSize - 1;
+  const uint8_t hashBits = std::min(windowBits, (uint8_t)WS_DEFLATE_MAX_HASH_BITS);
+
+  // position + 1 of the last string starting with the same 3 bytes, 0 if none
+  std::unique_ptr<uint32_t[]> head(new (std::nothrow) uint32_t[(size_t)1 << hashBits]());
+  // for each position in the window, distance to the previous string with the same hash, 0 if none
+  std::unique_ptr<uint16_t[]> prev(new (std::nothrow) uint16_t[windowSize]);
+  // the compressed message is only worth sending if it is smaller
+  std::unique_ptr<uint8_t[]> out(new (std::nothrow) uint8_t[len - 1]);
+  if (!head || !prev || !out) {
+    return nullptr;
+  }
+
+  auto insert = [&](size_t pos) {
+    if (pos + WS_DEFLATE_MIN_MATCH > len) {
+      return;
+    }
+    const uint32_t h = hash3(data + pos, hashBits);
+    const size_t distance = head[h] ? pos + 1 - head[h] : 0;
+    prev[pos & windowMask] = distance < windowSize ? distance : 0;
+    head[h] = pos + 1;
+  };
+
+  BitWriter w(out.get(), len - 1);
+  // BFINAL = 0, BTYPE = 01 (fixed Huffman codes)
+  w.bits(0x02, 3);
+
+  size_t pos = 0;
+  while (pos < len && !w.overflow()) {
+    size_t bestLength = 0;
+    size_t bestDistance = 0;
+
+    if (pos + WS_DEFLATE_MIN_MATCH <= len) {
+      const size_t maxLength = std::min(len - pos, (size_t)WS_DEFLATE_MAX_MATCH);
+      size_t candidate = head[hash3(data + pos, hashBits)];
+      for (uint8_t chain = WS_DEFLATE_MAX_CHAIN; candidate && chain; chain--) {
+        const size_t match = candidate - 1;
+        const size_t distance = pos - match;
+        // older positions of the window have been overwritten in prev[]
+        if (distance >= windowSize) {
+          break;
+        }
+        if (data[match + bestLength] == data[pos + bestLength]) {
+          size_t length = 0;
+          while (length < maxLength && data[match + length] == data[pos + length]) {
+            length++;
+          }
+          if (length > bestLength) {
+            bestLength = length;
+            bestDistance = distance;
+            if (length == maxLength) {
+              break;
+            }
+          }
+        }
+        const uint16_t step = prev[match & windowMask];
+        candidate = step ? candidate - step : 0;
+      }
+    }
+
+    if (bestLength > WS_DEFLATE_MIN_MATCH || (bestLength == WS_DEFLATE_MIN_MATCH && bestDistance <= WS_DEFLATE_TOO_FAR)) {
+      writeMatch(w, bestLength, bestDistance);
+      for (size_t i = 0; i < bestLength; i++) {
+        insert(pos + i);
+      }
+      pos += bestLength;
+    } else {
+      writeSymbol(w, data[pos]);
+      insert(pos);
+      pos++;
+    }
+  }
+
+  // end of block
+  writeSymbol(w, 256);
+  // empty stored block (BFINAL = 0, BTYPE = 00): RFC 7692 requires to strip its 0x00 0x00 0xff 0xff length fields
+  w.bits(0, 3);
+  w.flush();
+
+  if (w.overflow()) {
+    return nullptr;
+  }
+  return std::make_shared<std::vector<uint8_t>>(out.get(), out.get() + w.length());
+}
+
+WsInflateStatus wsInflate(const uint8_t *data, size_t len, std::vector<uint8_t> &out, size_t maxSize) {
+  out.clear();
+
+  std::unique_ptr<InflateTables> tables(new (std::nothrow) InflateTables);
+  if (!tables) {
+    return WS_INFLATE_ERROR;
+  }
+
+  BitReader r(data, len);
+  bool last;
+  do {
+    last = r.bits(1);
+    const uint32_t type = r.bits(2);
+    if (r.error()) {
+      return WS_INFLATE_ERROR;
+    }
+
+    WsInflateStatus status;
+    if (type == 0) {
+      status = inflateStored(r, out, maxSize);
+    } else if (type == 1) {
+      status = inflateFixed(r, out, maxSize, *tables);
+    } else if (type == 2) {
+      status = inflateDynamic(r, out, maxSize, *tables);
+    } else {
+      status = WS_INFLATE_ERROR;
+    }
+    if (status != WS_INFLATE_OK) {
+      return status;
+    }
+  } while (!last && r.hasMore());
+
+  return WS_INFLATE_OK;
+}
+
+}  // namespace asyncsrv
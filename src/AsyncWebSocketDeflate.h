@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright 2016-2026 Hristo Gochkov, Mathieu Carbou, Emil Muratov, Will Miles
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+// permessage-deflate: base-2 logarithm of the LZ77 window used to compress outgoing messages
+#ifndef WS_DEFLATE_WINDOW_BITS
+#ifdef ESP8266
+#define WS_DEFLATE_WINDOW_BITS 9
+#else
+#define WS_DEFLATE_WINDOW_BITS 11
+#endif
+#endif
+
+// permessage-deflate: outgoing messages smaller than this are sent uncompressed
+#ifndef WS_DEFLATE_THRESHOLD
+#define WS_DEFLATE_THRESHOLD 128
+#endif
+
+// permessage-deflate: max size of a compressed message received from a client, once decompressed
+#ifndef WS_DEFLATE_MAX_MESSAGE_SIZE
+#ifdef ESP8266
+#define WS_DEFLATE_MAX_MESSAGE_SIZE 4096
+#else
+#define WS_DEFLATE_MAX_MESSAGE_SIZE 16384
+#endif
+#endif
+
+/**
+ * Minimal raw DEFLATE (RFC 1951) codec for the WebSocket permessage-deflate extension (RFC 7692).
+ * Messages are processed as a whole, without context takeover between them:
+ * - the compressor emits a single block with the fixed Huffman codes, its LZ77 matches are searched in a window of 2^windowBits bytes
+ *   and its RAM usage is bounded by the window size, not by the message size
+ * - the inflater decodes all block types from a buffer holding the whole compressed message
+ */
+namespace asyncsrv {
+
+typedef enum {
+  WS_INFLATE_OK,
+  WS_INFLATE_ERROR,
+  WS_INFLATE_TOO_LARGE
+} WsInflateStatus;
+
+/**
+ * @brief compress a message payload as defined in RFC 7692 section 7.2.1, i.e. without the trailing 0x00 0x00 0xff 0xff
+ *
+ * @param windowBits base-2 logarithm of the LZ77 window, from 8 to 15
+ * @return the compressed payload, or nullptr if compression would not save any space or allocation failed
+ */
+std::shared_ptr<std::vector<uint8_t>> wsDeflate(const uint8_t *data, size_t len, uint8_t windowBits);
+
+/**
+ * @brief decompress a whole message payload, the trailing 0x00 0x00 0xff 0xff removed by the sender must have been appended back
+ *
+ * @param out receives the decompressed payload
+ * @param maxSize max size of the decompressed payload
+ */
+WsInflateStatus wsInflate(const uint8_t *data, size_t len, std::vector<uint8_t> &out, size_t maxSize);
+
+}  // namespace asyncsrv
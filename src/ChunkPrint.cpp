@@ -3,21 +3,25 @@
 
 #include <ChunkPrint.h>
 
-size_t ChunkPrint::write(uint8_t c) {
+#include <string.h>
+
+#include <algorithm>
+
+size_t ChunkPrint::write(const uint8_t *buffer, size_t size) {
   // handle case where len is zero
   if (!_len) {
     return 0;
   }
   // skip first bytes until from is zero (bytes were already sent by previous chunk)
-  if (_from) {
-    _from--;
-    return 1;
-  }
+  const size_t skipped = std::min(size, _from);
+  _from -= skipped;
+  buffer += skipped;
+  size -= skipped;
   // write a maximum of len bytes
-  if (_len - _index) {
-    _destination[_index++] = c;
-    return 1;
-  }
-  // we have finished writing len bytes, ignore the rest
-  return 0;
+  const size_t copied = std::min(size, _len - _index);
+  memcpy(_destination + _index, buffer, copied);
+  _index += copied;
+  // we have finished writing len bytes, keep the rest if there is room for it or ignore it
+  const size_t kept = (_overflow && copied < size) ? _overflow->append(buffer + copied, size - copied) : 0;
+  return skipped + copied + kept;
 }
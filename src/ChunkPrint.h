@@ -5,19 +5,24 @@
 
 #include <Print.h>
 
+#include "AsyncRingBuffer.h"
+
 class ChunkPrint : public Print {
 private:
   uint8_t *_destination;
   size_t _from;
   size_t _len;
   size_t _index;
+  // optional storage for the bytes following the chunk
+  AsyncRingBuffer *_overflow;
 
 public:
-  ChunkPrint(uint8_t *destination, size_t from, size_t len) : _destination(destination), _from(from), _len(len), _index(0) {}
-  size_t write(uint8_t c);
-  size_t write(const uint8_t *buffer, size_t size) {
-    return this->Print::write(buffer, size);
+  ChunkPrint(uint8_t *destination, size_t from, size_t len, AsyncRingBuffer *overflow = nullptr)
+    : _destination(destination), _from(from), _len(len), _index(0), _overflow(overflow) {}
+  size_t write(uint8_t c) {
+    return write(&c, 1);
   }
+  size_t write(const uint8_t *buffer, size_t size);
   size_t written() const {
     return _index;
   }
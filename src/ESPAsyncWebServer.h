@@ -415,6 +415,14 @@ typedef enum {
 
 typedef std::function<size_t(uint8_t *, size_t, size_t)> AwsResponseFiller;
 typedef std::function<String(const String &)> AwsTemplateProcessor;
+/**
+ * @brief Streaming template processor: prints the value of the placeholder @p var to @p output
+ * The value could be of any size, it is delivered in as many calls as needed: @p index is the num of value bytes
+ * already accepted by the output in previous calls for the same placeholder, output.availableForWrite() is the room left in the current buffer.
+ * Bytes printed beyond that room are held back up to TEMPLATE_CACHE_MAX_SIZE, a short write means the output is full.
+ * @return true when the whole value was printed, false to be called again once the output has room
+ */
+typedef std::function<bool(const String &var, Print &output, size_t index)> AwsTemplateStreamProcessor;
 
 using AsyncWebServerRequestPtr = std::weak_ptr<AsyncWebServerRequest>;
 
@@ -438,6 +446,13 @@ private:
   bool _paused = false;                          // request is paused (request continuation)
   std::shared_ptr<AsyncWebServerRequest> _this;  // shared pointer to this request
 
+  // tracks what happened to the request while it handles received data or a resumed send(), see clientRelease()
+  struct CallbackState {
+    bool released = false;  // the connection was handed over
+    bool deleted = false;   // the request was deleted
+  };
+  CallbackState *_callbackState = nullptr;
+
   String _temp;
   uint8_t _parseState;
 
@@ -491,6 +506,8 @@ private:
   void _onTimeout(uint32_t time);
   void _onDisconnect();
   void _onData(void *buf, size_t len);
+  // _onData(), then delete the request if it handed its connection over meanwhile
+  void _handleData(void *buf, size_t len);
 
   bool _parseReqHead();
   bool _parseReqHeader();
@@ -524,6 +541,8 @@ public:
    * AsyncClient pointer will be abandoned in this instance,
    * the further ownership of the connection should be managed out of request's life-time scope
    * could be used for long lived connection like SSE or WebSockets
+   * If it is called while the request is handled, the request is deleted once the current AsyncTCP callback returns,
+   * so the new owner can use the connection right away without having to delete the request from within its own call stack.
    * @note do not call this method unless you know what you are doing, otherwise it may lead to
    * memory leaks and connections lingering
    *
@@ -639,17 +658,36 @@ public:
     send(beginResponse(code, contentType.c_str(), content.c_str(), callback));
   }
 
+  // with a template processor, the template compiled from @p content is kept for the next responses with the same address and length:
+  // the content must not change (see TEMPLATE_PROGMEM_CACHE_ENTRIES)
   void send(int code, const char *contentType, const uint8_t *content, size_t len, AwsTemplateProcessor callback = nullptr) {
     send(beginResponse(code, contentType, content, len, callback));
   }
   void send(int code, const String &contentType, const uint8_t *content, size_t len, AwsTemplateProcessor callback = nullptr) {
     send(beginResponse(code, contentType, content, len, callback));
   }
+  void send(int code, const char *contentType, const uint8_t *content, size_t len, AwsTemplateStreamProcessor callback) {
+    send(beginResponse(code, contentType, content, len, callback));
+  }
+  void send(int code, const String &contentType, const uint8_t *content, size_t len, AwsTemplateStreamProcessor callback) {
+    send(beginResponse(code, contentType, content, len, callback));
+  }
 
   void send(FS &fs, const String &path, const char *contentType = asyncsrv::empty, bool download = false, AwsTemplateProcessor callback = nullptr);
   void send(FS &fs, const String &path, const String &contentType, bool download = false, AwsTemplateProcessor callback = nullptr) {
     send(fs, path, contentType.c_str(), download, callback);
   }
+  void send(FS &fs, const String &path, const char *contentType, bool download, AwsTemplateStreamProcessor callback) {
+    AsyncWebServerResponse *response = beginResponse(fs, path, contentType, download, callback);
+    if (response) {
+      send(response);
+    } else {
+      send(404);
+    }
+  }
+  void send(FS &fs, const String &path, const String &contentType, bool download, AwsTemplateStreamProcessor callback) {
+    send(fs, path, contentType.c_str(), download, callback);
+  }
 
   void send(File content, const String &path, const char *contentType = asyncsrv::empty, bool download = false, AwsTemplateProcessor callback = nullptr) {
     if (content) {
@@ -661,6 +699,16 @@ public:
   void send(File content, const String &path, const String &contentType, bool download = false, AwsTemplateProcessor callback = nullptr) {
     send(content, path, contentType.c_str(), download, callback);
   }
+  void send(File content, const String &path, const char *contentType, bool download, AwsTemplateStreamProcessor callback) {
+    if (content) {
+      send(beginResponse(content, path, contentType, download, callback));
+    } else {
+      send(404);
+    }
+  }
+  void send(File content, const String &path, const String &contentType, bool download, AwsTemplateStreamProcessor callback) {
+    send(content, path, contentType.c_str(), download, callback);
+  }
 
   void send(Stream &stream, const char *contentType, size_t len, AwsTemplateProcessor callback = nullptr) {
     send(beginResponse(stream, contentType, len, callback));
@@ -713,6 +761,10 @@ public:
   AsyncWebServerResponse *beginResponse(int code, const String &contentType, const uint8_t *content, size_t len, AwsTemplateProcessor callback = nullptr) {
     return beginResponse(code, contentType.c_str(), content, len, callback);
   }
+  AsyncWebServerResponse *beginResponse(int code, const char *contentType, const uint8_t *content, size_t len, AwsTemplateStreamProcessor callback);
+  AsyncWebServerResponse *beginResponse(int code, const String &contentType, const uint8_t *content, size_t len, AwsTemplateStreamProcessor callback) {
+    return beginResponse(code, contentType.c_str(), content, len, callback);
+  }
 
   AsyncWebServerResponse *
     beginResponse(FS &fs, const String &path, const char *contentType = asyncsrv::empty, bool download = false, AwsTemplateProcessor callback = nullptr);
@@ -721,6 +773,10 @@ public:
   ) {
     return beginResponse(fs, path, contentType.c_str(), download, callback);
   }
+  AsyncWebServerResponse *beginResponse(FS &fs, const String &path, const char *contentType, bool download, AwsTemplateStreamProcessor callback);
+  AsyncWebServerResponse *beginResponse(FS &fs, const String &path, const String &contentType, bool download, AwsTemplateStreamProcessor callback) {
+    return beginResponse(fs, path, contentType.c_str(), download, callback);
+  }
 
   AsyncWebServerResponse *
     beginResponse(File content, const String &path, const char *contentType = asyncsrv::empty, bool download = false, AwsTemplateProcessor callback = nullptr);
@@ -729,6 +785,10 @@ public:
   ) {
     return beginResponse(content, path, contentType.c_str(), download, callback);
   }
+  AsyncWebServerResponse *beginResponse(File content, const String &path, const char *contentType, bool download, AwsTemplateStreamProcessor callback);
+  AsyncWebServerResponse *beginResponse(File content, const String &path, const String &contentType, bool download, AwsTemplateStreamProcessor callback) {
+    return beginResponse(content, path, contentType.c_str(), download, callback);
+  }
 
   AsyncWebServerResponse *beginResponse(Stream &stream, const char *contentType, size_t len, AwsTemplateProcessor callback = nullptr);
   AsyncWebServerResponse *beginResponse(Stream &stream, const String &contentType, size_t len, AwsTemplateProcessor callback = nullptr) {
@@ -25,6 +25,7 @@ protected:
   String _cache_control;
   String _shared_eTag;
   AwsTemplateProcessor _callback;
+  AwsTemplateStreamProcessor _streamCallback;
   bool _isDir;
   bool _tryGzipFirst = true;
 
@@ -46,6 +47,8 @@ public:
   AsyncStaticWebHandler &setSharedEtag(const char *etag);
 
   AsyncStaticWebHandler &setTemplateProcessor(AwsTemplateProcessor newCallback);
+  // replaces a processor set by the overload above, and vice versa
+  AsyncStaticWebHandler &setTemplateProcessor(AwsTemplateStreamProcessor newCallback);
 };
 
 class AsyncCallbackWebHandler : public AsyncWebHandler {
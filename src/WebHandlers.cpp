@@ -193,6 +193,8 @@ void AsyncStaticWebHandler::handleRequest(AsyncWebServerRequest *request) {
   if (notModified) {
     request->_tempFile.close();
     response = new AsyncBasicResponse(304);  // Not modified
+  } else if (_streamCallback) {
+    response = new AsyncFileResponse(request->_tempFile, filename, asyncsrv::emptyString, false, _streamCallback);
   } else {
     response = new AsyncFileResponse(request->_tempFile, filename, asyncsrv::emptyString, false, _callback);
   }
@@ -219,6 +221,13 @@ void AsyncStaticWebHandler::handleRequest(AsyncWebServerRequest *request) {
 
 AsyncStaticWebHandler &AsyncStaticWebHandler::setTemplateProcessor(AwsTemplateProcessor newCallback) {
   _callback = newCallback;
+  _streamCallback = nullptr;
+  return *this;
+}
+
+AsyncStaticWebHandler &AsyncStaticWebHandler::setTemplateProcessor(AwsTemplateStreamProcessor newCallback) {
+  _streamCallback = newCallback;
+  _callback = nullptr;
   return *this;
 }
 
@@ -80,7 +80,7 @@ AsyncWebServerRequest::AsyncWebServerRequest(AsyncWebServer *s, AsyncClient *c)
     [](void *r, AsyncClient *c, void *buf, size_t len) {
       (void)c;
       // async_ws_log_e("AsyncWebServerRequest::_onData");
-      static_cast<AsyncWebServerRequest *>(r)->_onData(buf, len);
+      static_cast<AsyncWebServerRequest *>(r)->_handleData(buf, len);
     },
     this
   );
@@ -95,6 +95,10 @@ AsyncWebServerRequest::AsyncWebServerRequest(AsyncWebServer *s, AsyncClient *c)
 }
 
 AsyncWebServerRequest::~AsyncWebServerRequest() {
+  if (_callbackState) {
+    _callbackState->deleted = true;
+  }
+
   if (_client) {
     // usually it is _client's disconnect triggers object destruct, but for completeness we define behavior
     // if for some reason *this will be destructed while client is still connected
@@ -239,6 +243,20 @@ void AsyncWebServerRequest::_onData(void *buf, size_t len) {
   }
 }
 
+void AsyncWebServerRequest::_handleData(void *buf, size_t len) {
+  CallbackState state;
+  _callbackState = &state;
+  _onData(buf, len);
+  if (state.deleted) {
+    return;
+  }
+  _callbackState = nullptr;
+  // the connection was handed over to a WebSocket or SSE client while the request was handled, nothing refers to the request anymore
+  if (state.released) {
+    _server->_handleDisconnect(this);
+  }
+}
+
 void AsyncWebServerRequest::_onPoll() {
   // os_printf("p\n");
   if (_response && _client && _client->canSend()) {
@@ -1194,7 +1212,8 @@ double AsyncWebServerRequest::getAttribute(const char *name, double defaultValue
 
 AsyncWebServerResponse *AsyncWebServerRequest::beginResponse(int code, const char *contentType, const char *content, AwsTemplateProcessor callback) {
   if (callback) {
-    return new AsyncProgmemResponse(code, contentType, (const uint8_t *)content, strlen(content), callback);
+    // often the buffer of a String built for this response: the template is not cached by address
+    return new AsyncProgmemResponse(code, contentType, (const uint8_t *)content, strlen(content), callback, nullptr, false);
   }
   return new AsyncBasicResponse(code, contentType, content);
 }
@@ -1204,6 +1223,11 @@ AsyncWebServerResponse *
   return new AsyncProgmemResponse(code, contentType, content, len, callback);
 }
 
+AsyncWebServerResponse *
+  AsyncWebServerRequest::beginResponse(int code, const char *contentType, const uint8_t *content, size_t len, AwsTemplateStreamProcessor callback) {
+  return new AsyncProgmemResponse(code, contentType, content, len, callback);
+}
+
 AsyncWebServerResponse *
   AsyncWebServerRequest::beginResponse(FS &fs, const String &path, const char *contentType, bool download, AwsTemplateProcessor callback) {
   if (fs.exists(path) || (!download && fs.exists(path + T__gz))) {
@@ -1212,6 +1236,14 @@ AsyncWebServerResponse *
   return NULL;
 }
 
+AsyncWebServerResponse *
+  AsyncWebServerRequest::beginResponse(FS &fs, const String &path, const char *contentType, bool download, AwsTemplateStreamProcessor callback) {
+  if (fs.exists(path) || (!download && fs.exists(path + T__gz))) {
+    return new AsyncFileResponse(fs, path, contentType, download, callback);
+  }
+  return NULL;
+}
+
 AsyncWebServerResponse *
   AsyncWebServerRequest::beginResponse(File content, const String &path, const char *contentType, bool download, AwsTemplateProcessor callback) {
   if (content == true) {
@@ -1220,6 +1252,14 @@ AsyncWebServerResponse *
   return NULL;
 }
 
+AsyncWebServerResponse *
+  AsyncWebServerRequest::beginResponse(File content, const String &path, const char *contentType, bool download, AwsTemplateStreamProcessor callback) {
+  if (content == true) {
+    return new AsyncFileResponse(content, path, contentType, download, callback);
+  }
+  return NULL;
+}
+
 AsyncWebServerResponse *AsyncWebServerRequest::beginResponse(Stream &stream, const char *contentType, size_t len, AwsTemplateProcessor callback) {
   return new AsyncStreamResponse(stream, contentType, len, callback);
 }
@@ -1260,7 +1300,21 @@ void AsyncWebServerRequest::send(AsyncWebServerResponse *response) {
   // if request was paused, we need to send the response now
   if (_paused) {
     _paused = false;
+    if (_callbackState) {
+      // the data callback being processed deletes the request if needed
+      _send();
+      return;
+    }
+    CallbackState state;
+    _callbackState = &state;
     _send();
+    if (state.deleted) {
+      return;
+    }
+    _callbackState = nullptr;
+    if (state.released) {
+      _server->_handleDisconnect(this);
+    }
   }
 }
 
@@ -1467,6 +1521,9 @@ bool AsyncWebServerRequest::isExpectedRequestedConnType(RequestedConnectionType
 AsyncClient *AsyncWebServerRequest::clientRelease() {
   AsyncClient *c = _client;
   _client = nullptr;
+  if (_callbackState) {
+    _callbackState->released = true;
+  }
   return c;
 }
 
@@ -14,6 +14,7 @@
 #include <vector>
 
 #include "./literals.h"
+#include "AsyncRingBuffer.h"
 
 #ifndef CONFIG_LWIP_TCP_MSS
 #ifdef TCP_MSS  // ESP8266
@@ -27,6 +28,12 @@
 #define ASYNC_RESPONCE_BUFF_SIZE CONFIG_LWIP_TCP_MSS * 2
 // It is possible to restore these defines, but one can use _min and _max instead. Or std::min, std::max.
 
+// max amount of template processing output that could be held back between buffer fills,
+// i.e. a placeholder value longer than the send buffer plus this size would be truncated
+#ifndef TEMPLATE_CACHE_MAX_SIZE
+#define TEMPLATE_CACHE_MAX_SIZE 16384
+#endif
+
 class AsyncBasicResponse : public AsyncWebServerResponse {
 private:
   String _content;
@@ -61,6 +68,63 @@ protected:
   size_t write_send_buffs(AsyncWebServerRequest *request, size_t len, uint32_t time);
 };
 
+#ifndef TEMPLATE_PLACEHOLDER
+#define TEMPLATE_PLACEHOLDER '%'
+#endif
+
+#define TEMPLATE_PARAM_NAME_LENGTH 32
+
+// number of compiled template files kept in memory, 0 disables the cache
+#ifndef TEMPLATE_FILE_CACHE_ENTRIES
+#define TEMPLATE_FILE_CACHE_ENTRIES 4
+#endif
+
+// number of compiled PROGMEM templates kept in memory, 0 disables the cache
+#ifndef TEMPLATE_PROGMEM_CACHE_ENTRIES
+#define TEMPLATE_PROGMEM_CACHE_ENTRIES 4
+#endif
+
+/**
+ * @brief Template content split into literal ranges and placeholders
+ * Segments follow the source content in order, so a template is rendered by reading the source sequentially:
+ * literal segments are copied as is, placeholder segments are skipped in the source and replaced by the processor output.
+ * Once compiled the object is immutable and could be shared by many responses.
+ */
+class AsyncCompiledTemplate {
+public:
+  // segment ids that are not placeholder ids
+  static constexpr uint16_t LITERAL = 0xFFFF;
+  static constexpr uint16_t SKIP = 0xFFFE;
+
+  struct Segment {
+    // num of source bytes covered by the segment
+    uint32_t length;
+    // LITERAL, SKIP (escaped placeholder char) or index in names
+    uint16_t id;
+  };
+
+  std::vector<Segment> segments;
+  // unique placeholder names, referenced by segment id
+  std::vector<String> names;
+
+  /**
+   * @brief parse next part of the template source
+   * @note source could be fed in pieces of any size, placeholders split between pieces are handled
+   */
+  void feed(const uint8_t *data, size_t len);
+  // complete the parsing once all the source was fed
+  void finish();
+
+private:
+  uint8_t _name[TEMPLATE_PARAM_NAME_LENGTH];
+  size_t _nameLen{0};
+  size_t _literalLen{0};
+  bool _inName{false};
+
+  void _flushLiteral();
+  void _addPlaceholder();
+};
+
 class AsyncAbstractResponse : public AsyncWebServerResponse {
 private:
 #if ASYNCWEBSERVER_USE_CHUNK_INFLIGHT
@@ -73,20 +137,30 @@ private:
   String _assembled_headers;
   // amount of headers buffer writtent to sockbuff
   size_t _writtenHeadersLength{0};
-  // Data is inserted into cache at begin().
-  // This is inefficient with vector, but if we use some other container,
-  // we won't be able to access it as contiguous array of bytes when reading from it,
-  // so by gaining performance in one place, we'll lose it in another.
-  std::vector<uint8_t> _cache;
+  // Template processing output which did not fit into the send buffer, it is always read before the source content.
+  // Data is inserted into cache at the front, a ring buffer allows that and draining without moving stored bytes.
+  AsyncRingBuffer _cache{TEMPLATE_CACHE_MAX_SIZE};
+  // current position in the compiled template: segment index and source bytes already consumed in it
+  size_t _templateSegment{0};
+  size_t _templateSegmentOffset{0};
   // intermediate buffer to copy outbound data to, also it will keep pending data between _send calls
   std::unique_ptr<std::array<uint8_t, ASYNC_RESPONCE_BUFF_SIZE> > _send_buffer;
   // buffer data size specifiers
   size_t _send_buffer_offset{0}, _send_buffer_len{0};
   size_t _readDataFromCacheOrContent(uint8_t *data, const size_t len);
+  // put data in front of the cached data
+  void _cacheData(const uint8_t *data, size_t len);
   size_t _fillBufferAndProcessTemplates(uint8_t *buf, size_t maxLen);
+  size_t _fillBufferFromTemplate(uint8_t *buf, size_t maxLen);
 
 protected:
   AwsTemplateProcessor _callback;
+  // streaming alternative to _callback, works with compiled templates only
+  AwsTemplateStreamProcessor _streamCallback;
+  // num of value bytes already printed by _streamCallback for the current placeholder
+  size_t _templateValueIndex{0};
+  // compiled template of the content, if set it is used instead of scanning the content for placeholders
+  std::shared_ptr<const AsyncCompiledTemplate> _template;
   /**
    * @brief write next portion of response data to send buffs
    * this method (re)fills tcp send buffers, it could be called either at will
@@ -100,7 +174,7 @@ protected:
   size_t write_send_buffs(AsyncWebServerRequest *request, size_t len, uint32_t time);
 
 public:
-  AsyncAbstractResponse(AwsTemplateProcessor callback = nullptr);
+  AsyncAbstractResponse(AwsTemplateProcessor callback = nullptr, AwsTemplateStreamProcessor streamCallback = nullptr);
   virtual ~AsyncAbstractResponse() {}
   void _respond(AsyncWebServerRequest *request) final;
   size_t _ack(AsyncWebServerRequest *request, size_t len, uint32_t time) final {
@@ -114,11 +188,6 @@ public:
   }
 };
 
-#ifndef TEMPLATE_PLACEHOLDER
-#define TEMPLATE_PLACEHOLDER '%'
-#endif
-
-#define TEMPLATE_PARAM_NAME_LENGTH 32
 class AsyncFileResponse : public AsyncAbstractResponse {
   using File = fs::File;
   using FS = fs::FS;
@@ -126,16 +195,34 @@ class AsyncFileResponse : public AsyncAbstractResponse {
 private:
   File _content;
   void _setContentTypeFromPath(const String &path);
+  // get the compiled template for the file from the cache or compile it
+  void _loadTemplate(const String &path);
+  AsyncFileResponse(
+    FS &fs, const String &path, const char *contentType, bool download, AwsTemplateProcessor callback, AwsTemplateStreamProcessor streamCallback
+  );
+  AsyncFileResponse(
+    File content, const String &path, const char *contentType, bool download, AwsTemplateProcessor callback, AwsTemplateStreamProcessor streamCallback
+  );
 
 public:
-  AsyncFileResponse(FS &fs, const String &path, const char *contentType = asyncsrv::empty, bool download = false, AwsTemplateProcessor callback = nullptr);
+  AsyncFileResponse(FS &fs, const String &path, const char *contentType = asyncsrv::empty, bool download = false, AwsTemplateProcessor callback = nullptr)
+    : AsyncFileResponse(fs, path, contentType, download, callback, nullptr) {}
   AsyncFileResponse(FS &fs, const String &path, const String &contentType, bool download = false, AwsTemplateProcessor callback = nullptr)
-    : AsyncFileResponse(fs, path, contentType.c_str(), download, callback) {}
+    : AsyncFileResponse(fs, path, contentType.c_str(), download, callback, nullptr) {}
+  AsyncFileResponse(FS &fs, const String &path, const char *contentType, bool download, AwsTemplateStreamProcessor callback)
+    : AsyncFileResponse(fs, path, contentType, download, nullptr, callback) {}
+  AsyncFileResponse(FS &fs, const String &path, const String &contentType, bool download, AwsTemplateStreamProcessor callback)
+    : AsyncFileResponse(fs, path, contentType.c_str(), download, nullptr, callback) {}
   AsyncFileResponse(
     File content, const String &path, const char *contentType = asyncsrv::empty, bool download = false, AwsTemplateProcessor callback = nullptr
-  );
+  )
+    : AsyncFileResponse(content, path, contentType, download, callback, nullptr) {}
   AsyncFileResponse(File content, const String &path, const String &contentType, bool download = false, AwsTemplateProcessor callback = nullptr)
-    : AsyncFileResponse(content, path, contentType.c_str(), download, callback) {}
+    : AsyncFileResponse(content, path, contentType.c_str(), download, callback, nullptr) {}
+  AsyncFileResponse(File content, const String &path, const char *contentType, bool download, AwsTemplateStreamProcessor callback)
+    : AsyncFileResponse(content, path, contentType, download, nullptr, callback) {}
+  AsyncFileResponse(File content, const String &path, const String &contentType, bool download, AwsTemplateStreamProcessor callback)
+    : AsyncFileResponse(content, path, contentType.c_str(), download, nullptr, callback) {}
   ~AsyncFileResponse() {
     _content.close();
   }
@@ -190,15 +277,28 @@ public:
 };
 
 class AsyncProgmemResponse : public AsyncAbstractResponse {
+  friend class AsyncWebServerRequest;
+
 private:
   const uint8_t *_content;
   // offset index (how much we've sent already)
   size_t _index;
+  // @p cacheTemplate: the compiled template is kept for the next responses with the same content address and length (see TEMPLATE_PROGMEM_CACHE_ENTRIES),
+  // the content must not change at this address
+  AsyncProgmemResponse(
+    int code, const char *contentType, const uint8_t *content, size_t len, AwsTemplateProcessor callback, AwsTemplateStreamProcessor streamCallback,
+    bool cacheTemplate
+  );
 
 public:
-  AsyncProgmemResponse(int code, const char *contentType, const uint8_t *content, size_t len, AwsTemplateProcessor callback = nullptr);
+  AsyncProgmemResponse(int code, const char *contentType, const uint8_t *content, size_t len, AwsTemplateProcessor callback = nullptr)
+    : AsyncProgmemResponse(code, contentType, content, len, callback, nullptr, true) {}
   AsyncProgmemResponse(int code, const String &contentType, const uint8_t *content, size_t len, AwsTemplateProcessor callback = nullptr)
-    : AsyncProgmemResponse(code, contentType.c_str(), content, len, callback) {}
+    : AsyncProgmemResponse(code, contentType.c_str(), content, len, callback, nullptr, true) {}
+  AsyncProgmemResponse(int code, const char *contentType, const uint8_t *content, size_t len, AwsTemplateStreamProcessor callback)
+    : AsyncProgmemResponse(code, contentType, content, len, nullptr, callback, true) {}
+  AsyncProgmemResponse(int code, const String &contentType, const uint8_t *content, size_t len, AwsTemplateStreamProcessor callback)
+    : AsyncProgmemResponse(code, contentType.c_str(), content, len, nullptr, callback, true) {}
   bool _sourceValid() const final {
     return true;
   }
@@ -6,6 +6,7 @@
 #include "AsyncWebServerLogging.h"
 
 #include <algorithm>
+#include <list>
 #include <memory>
 #include <utility>
 
@@ -327,9 +328,10 @@ size_t AsyncBasicResponse::write_send_buffs(AsyncWebServerRequest *request, size
  * Abstract Response
  *
  */
-AsyncAbstractResponse::AsyncAbstractResponse(AwsTemplateProcessor callback) : _callback(callback) {
+AsyncAbstractResponse::AsyncAbstractResponse(AwsTemplateProcessor callback, AwsTemplateStreamProcessor streamCallback)
+  : _callback(callback), _streamCallback(streamCallback) {
   // In case of template processing, we're unable to determine real response size
-  if (callback) {
+  if (callback || streamCallback) {
     _contentLength = 0;
     _sendContentLength = false;
     _chunked = true;
@@ -493,6 +495,12 @@ size_t AsyncAbstractResponse::write_send_buffs(AsyncWebServerRequest *request, s
           }
         }
       }
+
+      if (_state == RESPONSE_FAILED) {
+        // template output could not be held back, see _cacheData()
+        request->client()->close();
+        return 0;
+      }
     } while (_send_buffer_len);  // go on till we have something in buffer pending to send
 
     // execute sending whatever we have in sock buffs now
@@ -520,18 +528,120 @@ size_t AsyncAbstractResponse::write_send_buffs(AsyncWebServerRequest *request, s
 
 size_t AsyncAbstractResponse::_readDataFromCacheOrContent(uint8_t *data, const size_t len) {
   // If we have something in cache, copy it to buffer
-  const size_t readFromCache = std::min(len, _cache.size());
-  if (readFromCache) {
-    memcpy(data, _cache.data(), readFromCache);
-    _cache.erase(_cache.begin(), _cache.begin() + readFromCache);
-  }
+  const size_t readFromCache = _cache.read(data, len);
   // If we need to read more...
   const size_t needFromFile = len - readFromCache;
   const size_t readFromContent = _fillBuffer(data + readFromCache, needFromFile);
   return readFromCache + readFromContent;
 }
 
+void AsyncAbstractResponse::_cacheData(const uint8_t *data, size_t len) {
+  const size_t cached = _cache.prepend(data, len);
+  if (cached != len) {
+    // the output would miss these bytes, fail the response instead of sending it corrupted
+    async_ws_log_e("Template cache overflow: %" PRIu32 " bytes dropped", static_cast<uint32_t>(len - cached));
+    _state = RESPONSE_FAILED;
+  }
+}
+
+namespace {
+// Output of a streaming template processor: fills the free part of the send buffer, the overflow is held back in the response cache
+class TemplateValuePrint : public Print {
+private:
+  uint8_t *_data;
+  size_t _room;
+  AsyncRingBuffer &_cache;
+
+public:
+  // num of bytes put to the send buffer
+  size_t written{0};
+  // num of bytes taken in total, including the ones held back in the cache
+  size_t accepted{0};
+
+  TemplateValuePrint(uint8_t *data, size_t room, AsyncRingBuffer &cache) : _data(data), _room(room), _cache(cache) {}
+
+  size_t write(uint8_t c) override {
+    return write(&c, 1);
+  }
+  size_t write(const uint8_t *buffer, size_t size) override {
+    const size_t copied = std::min(size, _room - written);
+    memcpy(_data + written, buffer, copied);
+    written += copied;
+    const size_t cached = copied < size ? _cache.append(buffer + copied, size - copied) : 0;
+    accepted += copied + cached;
+    return copied + cached;
+  }
+  int availableForWrite() override {
+    return _room - written;
+  }
+};
+}  // namespace
+
+size_t AsyncAbstractResponse::_fillBufferFromTemplate(uint8_t *data, size_t len) {
+  // processor output left from a previous call goes first
+  size_t written = _cache.read(data, len);
+  const std::vector<AsyncCompiledTemplate::Segment> &segments = _template->segments;
+
+  while (written < len && _templateSegment < segments.size()) {
+    const AsyncCompiledTemplate::Segment &segment = segments[_templateSegment];
+    if (segment.id == AsyncCompiledTemplate::LITERAL) {
+      // copy literal content straight from the source
+      const size_t readLen = _fillBuffer(data + written, std::min(len - written, (size_t)(segment.length - _templateSegmentOffset)));
+      if (readLen == 0 || readLen == RESPONSE_TRY_AGAIN) {
+        // content is shorter than it was when compiled
+        _templateSegment = segments.size();
+        break;
+      }
+      written += readLen;
+      _templateSegmentOffset += readLen;
+      if (_templateSegmentOffset < segment.length) {
+        continue;
+      }
+    } else {
+      if (_templateSegmentOffset == 0) {
+        // placeholder text is not part of the output, just consume it from the source
+        uint8_t placeholder[TEMPLATE_PARAM_NAME_LENGTH + 2];
+        _fillBuffer(placeholder, segment.length);
+        _templateSegmentOffset = segment.length;
+      }
+      if (segment.id != AsyncCompiledTemplate::SKIP && _streamCallback) {
+        TemplateValuePrint output(data + written, len - written, _cache);
+        const bool done = _streamCallback(_template->names[segment.id], output, _templateValueIndex);
+        written += output.written;
+        _templateValueIndex += output.accepted;
+        if (!done) {
+          // the rest of the value goes to the next buffer, or the processor has nothing to give right now
+          if (written == len || !output.accepted) {
+            break;
+          }
+          continue;
+        }
+        _templateValueIndex = 0;
+      } else if (segment.id != AsyncCompiledTemplate::SKIP) {
+        const String value(_callback(_template->names[segment.id]));
+        const size_t copied = std::min((size_t)value.length(), len - written);
+        memcpy(data + written, value.c_str(), copied);
+        written += copied;
+        if (copied < value.length()) {
+          _cacheData(reinterpret_cast<const uint8_t *>(value.c_str()) + copied, value.length() - copied);
+        }
+      }
+    }
+    ++_templateSegment;
+    _templateSegmentOffset = 0;
+  }
+  if (!written && _templateSegment < segments.size()) {
+    // a streaming processor is waiting for its data, returning 0 would end the response
+    return RESPONSE_TRY_AGAIN;
+  }
+  return written;
+}
+
 size_t AsyncAbstractResponse::_fillBufferAndProcessTemplates(uint8_t *data, size_t len) {
+  if (_template) {
+    return _fillBufferFromTemplate(data, len);
+  }
+
   if (!_callback) {
     return _fillBuffer(data, len);
   }
@@ -548,8 +658,10 @@ size_t AsyncAbstractResponse::_fillBufferAndProcessTemplates(uint8_t *data, size
     // temporary buffer to hold parameter name
     uint8_t buf[TEMPLATE_PARAM_NAME_LENGTH + 1];
     String paramName;
-    // If closing placeholder is found:
-    if (pTemplateEnd) {
+    if (pTemplateEnd && (size_t)(pTemplateEnd - pTemplateStart - 1) > TEMPLATE_PARAM_NAME_LENGTH) {
+      // too long for a parameter name, the placeholder char is regular content (as in compiled templates)
+      ++pTemplateStart;
+    } else if (pTemplateEnd) {  // If closing placeholder is found:
       // prepare argument to callback
       const size_t paramNameLength = std::min((size_t)sizeof(buf) - 1, (size_t)(pTemplateEnd - pTemplateStart - 1));
       if (paramNameLength) {
@@ -574,12 +686,12 @@ size_t AsyncAbstractResponse::_fillBufferAndProcessTemplates(uint8_t *data, size
           *pTemplateEnd = 0;
           paramName = String(reinterpret_cast<char *>(buf));
           // Copy remaining read-ahead data into cache
-          _cache.insert(_cache.begin(), pTemplateEnd + 1, buf + (&data[len - 1] - pTemplateStart) + readFromCacheOrContent);
+          _cacheData(pTemplateEnd + 1, buf + (&data[len - 1] - pTemplateStart) + readFromCacheOrContent - (pTemplateEnd + 1));
           pTemplateEnd = &data[len - 1];
         } else  // closing placeholder not found in file data, store found percent symbol as is and advance to the next position
         {
           // but first, store read file data in cache
-          _cache.insert(_cache.begin(), buf + (&data[len - 1] - pTemplateStart), buf + (&data[len - 1] - pTemplateStart) + readFromCacheOrContent);
+          _cacheData(buf + (&data[len - 1] - pTemplateStart), readFromCacheOrContent);
           ++pTemplateStart;
         }
       } else {  // closing placeholder not found in content data, store found percent symbol as is and advance to the next position
@@ -601,7 +713,8 @@ size_t AsyncAbstractResponse::_fillBufferAndProcessTemplates(uint8_t *data, size
       // make room for param value
       // 1. move extra data to cache if parameter value is longer than placeholder AND if there is no room to store
       if ((pTemplateEnd + 1 < pTemplateStart + numBytesCopied) && (originalLen - (pTemplateStart + numBytesCopied - pTemplateEnd - 1) < len)) {
-        _cache.insert(_cache.begin(), &data[originalLen - (pTemplateStart + numBytesCopied - pTemplateEnd - 1)], &data[len]);
+        const uint8_t *pSpill = &data[originalLen - (pTemplateStart + numBytesCopied - pTemplateEnd - 1)];
+        _cacheData(pSpill, &data[len] - pSpill);
         // 2. parameter value is longer than placeholder text, push the data after placeholder which not saved into cache further to the end
         memmove(pTemplateStart + numBytesCopied, pTemplateEnd + 1, &data[originalLen] - pTemplateStart - numBytesCopied);
         len = originalLen;  // fix issue with truncated data, not sure if it has any side effects
@@ -614,7 +727,7 @@ size_t AsyncAbstractResponse::_fillBufferAndProcessTemplates(uint8_t *data, size
       memcpy(pTemplateStart, pvstr, numBytesCopied);
       // If result is longer than buffer, copy the remainder into cache (this could happen only if placeholder text itself did not fit entirely in buffer)
       if (numBytesCopied < pvlen) {
-        _cache.insert(_cache.begin(), pvstr + numBytesCopied, pvstr + pvlen);
+        _cacheData(reinterpret_cast<const uint8_t *>(pvstr) + numBytesCopied, pvlen - numBytesCopied);
       } else if (pTemplateStart + numBytesCopied < pTemplateEnd + 1) {  // result is copied fully; if result is shorter than placeholder text...
         // there is some free room, fill it from cache
         const size_t roomFreed = pTemplateEnd + 1 - pTemplateStart - numBytesCopied;
@@ -629,10 +742,174 @@ size_t AsyncAbstractResponse::_fillBufferAndProcessTemplates(uint8_t *data, size
   return len;
 }
 
+/*
+ * Compiled Template
+ * */
+
+void AsyncCompiledTemplate::feed(const uint8_t *data, size_t len) {
+  const uint8_t *end = data + len;
+  while (data < end) {
+    if (!_inName) {
+      const uint8_t *pTemplateStart = (const uint8_t *)memchr(data, TEMPLATE_PLACEHOLDER, end - data);
+      if (!pTemplateStart) {
+        _literalLen += end - data;
+        return;
+      }
+      _literalLen += pTemplateStart - data;
+      data = pTemplateStart + 1;
+      _inName = true;
+      _nameLen = 0;
+      continue;
+    }
+
+    const uint8_t c = *data++;
+    if (c == TEMPLATE_PLACEHOLDER) {
+      _inName = false;
+      if (_nameLen) {
+        _addPlaceholder();
+      } else {
+        // double placeholder char is an escaped one: keep the first and skip the second
+        ++_literalLen;
+        _flushLiteral();
+        segments.push_back({1, SKIP});
+      }
+    } else if (_nameLen < TEMPLATE_PARAM_NAME_LENGTH) {
+      _name[_nameLen++] = c;
+    } else {
+      // too long for a parameter name, the placeholder char and what follows is regular content
+      _inName = false;
+      _literalLen += _nameLen + 2;
+    }
+  }
+}
+
+void AsyncCompiledTemplate::finish() {
+  if (_inName) {
+    // closing placeholder char not found
+    _inName = false;
+    _literalLen += _nameLen + 1;
+  }
+  _flushLiteral();
+}
+
+void AsyncCompiledTemplate::_flushLiteral() {
+  if (!_literalLen) {
+    return;
+  }
+  if (!segments.empty() && segments.back().id == LITERAL) {
+    segments.back().length += _literalLen;
+  } else {
+    segments.push_back({static_cast<uint32_t>(_literalLen), LITERAL});
+  }
+  _literalLen = 0;
+}
+
+void AsyncCompiledTemplate::_addPlaceholder() {
+  size_t id = 0;
+  while (id < names.size() && !(names[id].length() == _nameLen && memcmp(names[id].c_str(), _name, _nameLen) == 0)) {
+    ++id;
+  }
+  if (id == names.size()) {
+    if (id >= SKIP) {
+      // out of ids, keep the placeholder as is
+      _literalLen += _nameLen + 2;
+      return;
+    }
+    String name;
+    name.concat(reinterpret_cast<const char *>(_name), _nameLen);
+    names.push_back(std::move(name));
+  }
+  _flushLiteral();
+  segments.push_back({static_cast<uint32_t>(_nameLen + 2), static_cast<uint16_t>(id)});
+}
+
+#if TEMPLATE_PROGMEM_CACHE_ENTRIES
+namespace {
+struct ProgmemTemplateCacheEntry {
+  const uint8_t *content;
+  size_t len;
+  std::shared_ptr<const AsyncCompiledTemplate> compiled;
+};
+// most recently used first
+std::list<ProgmemTemplateCacheEntry> progmemTemplateCache;
+asyncsrv::mutex_type progmemTemplateCacheLock;
+}  // namespace
+#endif
+
 /*
  * File Response
  * */
 
+#if TEMPLATE_FILE_CACHE_ENTRIES
+namespace {
+struct TemplateCacheEntry {
+  String path;
+  time_t lastWrite;
+  size_t size;
+  std::shared_ptr<const AsyncCompiledTemplate> compiled;
+};
+// most recently used first
+std::list<TemplateCacheEntry> templateCache;
+asyncsrv::mutex_type templateCacheLock;
+}  // namespace
+#endif
+
+void AsyncFileResponse::_loadTemplate(const String &path) {
+  const size_t size = _content.size();
+#if TEMPLATE_FILE_CACHE_ENTRIES
+  // without modification time an outdated template could not be detected, such files are not cached
+  const time_t lastWrite = _content.getLastWrite();
+  if (lastWrite) {
+    asyncsrv::lock_guard_type lock(templateCacheLock);
+    for (auto i = templateCache.begin(); i != templateCache.end(); ++i) {
+      if (i->path == path) {
+        if (i->lastWrite == lastWrite && i->size == size) {
+          _template = i->compiled;
+          templateCache.splice(templateCache.begin(), templateCache, i);
+          return;
+        }
+        templateCache.erase(i);
+        break;
+      }
+    }
+  } else if (!_streamCallback) {
+    // content will be scanned on the fly
+    return;
+  }
+#else
+  if (!_streamCallback) {
+    return;
+  }
+#endif
+
+  // compile on first use, streaming processors always need a compiled template
+  std::shared_ptr<AsyncCompiledTemplate> compiled = std::make_shared<AsyncCompiledTemplate>();
+  uint8_t buf[256];
+  size_t total = 0;
+  size_t readLen;
+  while ((readLen = _content.read(buf, sizeof(buf))) > 0) {
+    compiled->feed(buf, readLen);
+    total += readLen;
+  }
+  compiled->finish();
+  if (!_content.seek(0) || total != size) {
+    async_ws_log_e("Failed to compile template: %s", path.c_str());
+    _content.seek(0);
+    return;
+  }
+
+#if TEMPLATE_FILE_CACHE_ENTRIES
+  if (lastWrite) {
+    asyncsrv::lock_guard_type lock(templateCacheLock);
+    templateCache.push_front({path, lastWrite, size, compiled});
+    if (templateCache.size() > TEMPLATE_FILE_CACHE_ENTRIES) {
+      templateCache.pop_back();
+    }
+  }
+#endif
+  _template = std::move(compiled);
+}
+
 /**
  * @brief Sets the content type based on the file path extension
  *
@@ -719,8 +996,10 @@ void AsyncFileResponse::_setContentTypeFromPath(const String &path) {
  * @param download If true, file will be served as download attachment; if false, as inline content
  * @param callback Template processor callback for dynamic content processing
  */
-AsyncFileResponse::AsyncFileResponse(FS &fs, const String &path, const char *contentType, bool download, AwsTemplateProcessor callback)
-  : AsyncAbstractResponse(callback) {
+AsyncFileResponse::AsyncFileResponse(
+  FS &fs, const String &path, const char *contentType, bool download, AwsTemplateProcessor callback, AwsTemplateStreamProcessor streamCallback
+)
+  : AsyncAbstractResponse(callback, streamCallback) {
 
   // Try to open the uncompressed version first
   _content = fs.open(path, fs::FileOpenMode::read);
@@ -737,6 +1016,7 @@ AsyncFileResponse::AsyncFileResponse(FS &fs, const String &path, const char *con
     if (AsyncWebServerRequest::_getEtag(_content, serverETag)) {
       addHeader(T_Content_Encoding, T_gzip, false);
       _callback = nullptr;  // Unable to process zipped templates
+      _streamCallback = nullptr;
       _sendContentLength = true;
       _chunked = false;
 
@@ -754,6 +1034,10 @@ AsyncFileResponse::AsyncFileResponse(FS &fs, const String &path, const char *con
 
   _contentLength = _content.size();
 
+  if (_callback || _streamCallback) {
+    _loadTemplate(path);
+  }
+
   if (*contentType == '\0') {
     _setContentTypeFromPath(path);
   } else {
@@ -778,13 +1062,16 @@ AsyncFileResponse::AsyncFileResponse(FS &fs, const String &path, const char *con
   _code = 200;
 }
 
-AsyncFileResponse::AsyncFileResponse(File content, const String &path, const char *contentType, bool download, AwsTemplateProcessor callback)
-  : AsyncAbstractResponse(callback) {
+AsyncFileResponse::AsyncFileResponse(
+  File content, const String &path, const char *contentType, bool download, AwsTemplateProcessor callback, AwsTemplateStreamProcessor streamCallback
+)
+  : AsyncAbstractResponse(callback, streamCallback) {
   _code = 200;
 
   if (String(content.name()).endsWith(T__gz) && !path.endsWith(T__gz)) {
     addHeader(T_Content_Encoding, T_gzip, false);
     _callback = nullptr;  // Unable to process gzipped templates
+    _streamCallback = nullptr;
     _sendContentLength = true;
     _chunked = false;
   }
@@ -792,6 +1079,10 @@ AsyncFileResponse::AsyncFileResponse(File content, const String &path, const cha
   _content = content;
   _contentLength = _content.size();
 
+  if (_callback || _streamCallback) {
+    _loadTemplate(path);
+  }
+
   if (*contentType == '\0') {
     _setContentTypeFromPath(path);
   } else {
@@ -890,11 +1181,51 @@ size_t AsyncChunkedResponse::_fillBuffer(uint8_t *data, size_t len) {
  * Progmem Response
  * */
 
-AsyncProgmemResponse::AsyncProgmemResponse(int code, const char *contentType, const uint8_t *content, size_t len, AwsTemplateProcessor callback)
-  : AsyncAbstractResponse(callback), _content(content), _index(0) {
+AsyncProgmemResponse::AsyncProgmemResponse(
+  int code, const char *contentType, const uint8_t *content, size_t len, AwsTemplateProcessor callback, AwsTemplateStreamProcessor streamCallback,
+  bool cacheTemplate
+)
+  : AsyncAbstractResponse(callback, streamCallback), _content(content), _index(0) {
   _code = code;
   _contentType = contentType;
   _contentLength = len;
+
+  if (_callback || _streamCallback) {
+#if TEMPLATE_PROGMEM_CACHE_ENTRIES
+    if (cacheTemplate) {
+      // the content is not read again: it must not change at a cached address
+      asyncsrv::lock_guard_type lock(progmemTemplateCacheLock);
+      for (auto i = progmemTemplateCache.begin(); i != progmemTemplateCache.end(); ++i) {
+        if (i->content == content && i->len == len) {
+          _template = i->compiled;
+          progmemTemplateCache.splice(progmemTemplateCache.begin(), progmemTemplateCache, i);
+          return;
+        }
+      }
+    }
+#endif
+
+    // content is already in memory, compiling it is a single pass over it
+    std::shared_ptr<AsyncCompiledTemplate> compiled = std::make_shared<AsyncCompiledTemplate>();
+    uint8_t buf[64];
+    for (size_t i = 0; i < len; i += sizeof(buf)) {
+      const size_t chunkLen = std::min(sizeof(buf), len - i);
+      memcpy_P(buf, content + i, chunkLen);
+      compiled->feed(buf, chunkLen);
+    }
+    compiled->finish();
+
+#if TEMPLATE_PROGMEM_CACHE_ENTRIES
+    if (cacheTemplate) {
+      asyncsrv::lock_guard_type lock(progmemTemplateCacheLock);
+      progmemTemplateCache.push_front({content, len, compiled});
+      if (progmemTemplateCache.size() > TEMPLATE_PROGMEM_CACHE_ENTRIES) {
+        progmemTemplateCache.pop_back();
+      }
+    }
+#endif
+    _template = std::move(compiled);
+  }
 }
 
 size_t AsyncProgmemResponse::_fillBuffer(uint8_t *data, size_t len) {